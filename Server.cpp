@@ -9,49 +9,186 @@
 #include <functional>
 #include <mutex>
 #include <optional>
-#include <shared_mutex>
 #include <queue>
+#include <deque>
 #include <stdexcept>
 #include <string>
 #include <thread>
 #include <memory>
 #include <tuple>
-#include <unordered_map>
 #include <vector>
 #include <array>
+#include <cstring>
 #include <future>
 
+#include <chrono>
+#include <atomic>
+#include <bit>
+
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 
+#ifdef __linux__
+	#include <netinet/in.h>
+	#include <linux/errqueue.h>
+#endif
+
 #ifdef __APPLE__
 	#include <sys/disk.h>
 #endif
 
+#if defined(__SSE2__)
+	#include <emmintrin.h>
+	#ifdef __SSE4_1__
+		#include <smmintrin.h>
+	#endif
+#elif defined(__ARM_NEON)
+	#include <arm_neon.h>
+#endif
+
 std::string ADDRESS=getEnv("CONN_SERVER_ADDRESS", "192.168.64.1");
 int PORT=getEnv("CONN_SERVER_PORT", 4000);
 
 bool is_guest; 
+bool uncached_ring; //Whether the rings are mapped from the write-combining PCI BAR (only on the guest), so they should only be touched in whole, aligned bursts
+
+/*
+Each drive is split into NUM_SHARDS equal shards, each an independent ring (connections are assigned to one by their thread id, and each one has its own reader). Each shard starts with two counters, each on its own cache line (so the two sides never write to the same one):
+	<head of the other drive's ring (in the same shard)>, written by us as its reader
+	<tail of this drive's ring>, written by us as its writer
+Both count bytes from the start, and never wrap (positions in the ring are taken mod the ring's size).
+
+The rest is a ring of variable-length records: a 12-byte <thread><type><arg1> header, followed by arg1 bytes of payload for DATA, padded to RECORD_ALIGN. A record never wraps around --- if it doesn't fit before the end, a PADDING record fills up the rest of the ring. A DATA record whose payload couldn't be read is published as a PADDING record with the same arg1, which the reader skips over like the DATA record it replaces.
+*/
+#define CACHE_LINE 64
+#define RING_HEADER_SIZE (2*CACHE_LINE)
+#define RECORD_ALIGN 16 //So there's always room for a PADDING header at the end of the ring
+
+uint64_t recordSize(uint32_t payload){
+	return (12 + payload + RECORD_ALIGN - 1) & ~(uint64_t)(RECORD_ALIGN - 1);
+}
 
-#define NUM_SEGMENTS 256 //Must be no bigger than 256 (since the information is stored in a single byte
+/*
+Reads from the BAR are uncached, and writes only go out at full speed when they fill whole write-combining buffers. So records are built in local memory and copied in with one pass of aligned, non-temporal stores, and copied back out with one pass of aligned (streaming, where there is SSE4.1) loads before anything else looks at them.
+Both copy RECORD_ALIGN bytes at a time: the ring side has to be aligned to it, and both sides have to have room for size rounded up to it (records are padded to it anyway).
+*/
+void copyToRing(uint8_t* dst, const uint8_t* src, uint64_t size){
+	size = (size + RECORD_ALIGN - 1) & ~(uint64_t)(RECORD_ALIGN - 1);
+	uint64_t i = 0;
+	#if defined(__SSE2__)
+		for(; i + CACHE_LINE <= size; i += CACHE_LINE){
+			auto a = _mm_loadu_si128((const __m128i*)(src+i));
+			auto b = _mm_loadu_si128((const __m128i*)(src+i+16));
+			auto c = _mm_loadu_si128((const __m128i*)(src+i+32));
+			auto d = _mm_loadu_si128((const __m128i*)(src+i+48));
+			_mm_stream_si128((__m128i*)(dst+i), a);
+			_mm_stream_si128((__m128i*)(dst+i+16), b);
+			_mm_stream_si128((__m128i*)(dst+i+32), c);
+			_mm_stream_si128((__m128i*)(dst+i+48), d);
+		}
+		for(; i < size; i += 16){
+			_mm_stream_si128((__m128i*)(dst+i), _mm_loadu_si128((const __m128i*)(src+i)));
+		}
+		_mm_sfence(); //Streaming stores aren't ordered with the store that publishes the record
+	#elif defined(__ARM_NEON) //There are no non-temporal intrinsics, but full 64-byte bursts still fill the write-combining buffers
+		for(; i + CACHE_LINE <= size; i += CACHE_LINE){
+			auto a = vld1q_u8(src+i);
+			auto b = vld1q_u8(src+i+16);
+			auto c = vld1q_u8(src+i+32);
+			auto d = vld1q_u8(src+i+48);
+			vst1q_u8(dst+i, a);
+			vst1q_u8(dst+i+16, b);
+			vst1q_u8(dst+i+32, c);
+			vst1q_u8(dst+i+48, d);
+		}
+		for(; i < size; i += 16){
+			vst1q_u8(dst+i, vld1q_u8(src+i));
+		}
+	#else
+		memcpy(dst, src, size);
+	#endif
+}
+
+void copyFromRing(uint8_t* dst, const uint8_t* src, uint64_t size){
+	size = (size + RECORD_ALIGN - 1) & ~(uint64_t)(RECORD_ALIGN - 1);
+	uint64_t i = 0;
+	#if defined(__SSE2__)
+		#ifdef __SSE4_1__
+			#define LOAD_RING(p) _mm_stream_load_si128((__m128i*)(p))
+		#else
+			#define LOAD_RING(p) _mm_load_si128((const __m128i*)(p))
+		#endif
+		for(; i + CACHE_LINE <= size; i += CACHE_LINE){
+			auto a = LOAD_RING(src+i);
+			auto b = LOAD_RING(src+i+16);
+			auto c = LOAD_RING(src+i+32);
+			auto d = LOAD_RING(src+i+48);
+			_mm_storeu_si128((__m128i*)(dst+i), a);
+			_mm_storeu_si128((__m128i*)(dst+i+16), b);
+			_mm_storeu_si128((__m128i*)(dst+i+32), c);
+			_mm_storeu_si128((__m128i*)(dst+i+48), d);
+		}
+		for(; i < size; i += 16){
+			_mm_storeu_si128((__m128i*)(dst+i), LOAD_RING(src+i));
+		}
+		#undef LOAD_RING
+	#elif defined(__ARM_NEON)
+		for(; i + CACHE_LINE <= size; i += CACHE_LINE){
+			auto a = vld1q_u8(src+i);
+			auto b = vld1q_u8(src+i+16);
+			auto c = vld1q_u8(src+i+32);
+			auto d = vld1q_u8(src+i+48);
+			vst1q_u8(dst+i, a);
+			vst1q_u8(dst+i+16, b);
+			vst1q_u8(dst+i+32, c);
+			vst1q_u8(dst+i+48, d);
+		}
+		for(; i < size; i += 16){
+			vst1q_u8(dst+i, vld1q_u8(src+i));
+		}
+	#else
+		memcpy(dst, src, size);
+	#endif
+}
+
+int NUM_SHARDS = std::max(getEnv("CONN_SERVER_SHARDS", 1), 1); //Has to be the same on both sides
+uint32_t SLOT_BITS = std::bit_width(uint32_t(std::max(getEnv("CONN_SERVER_MAX_CONNECTIONS", 4096), 2) - 1)); //Has to be the same on both sides (see ConnSlot)
+uint32_t SLOT_MASK = (1u << SLOT_BITS) - 1;
+
+/*
+Connections get the priority of their backend (see BackendInfo). When the ring is contended, a producer can only reserve space once every producer of a higher priority has, and lower priorities can't fill the last PRIORITY_HEADROOM of the ring for each level they are below the top, so there is always room for interactive messages to go out right away.
+On top of that, each connection can only have CREDIT bytes of data in the ring that the reader hasn't gotten to yet, so a bulk transfer can't take up the whole ring for itself.
+*/
+#define MAX_PRIORITY 2
+#define PRIORITY_HEADROOM 8 //As a fraction of the ring
+uint64_t CREDIT = getEnv("CONN_SERVER_CREDIT", 1024*1024);
 
 typedef struct {
-	uint32_t offset;
-	uint32_t size;
-} SegmentInfo;
+	uint8_t* header; //Where the counters are
+	uint8_t* ring; //Where the records start
+	size_t size; //Of the ring
+
+	uint64_t* head;
+	uint64_t* tail;
+
+	std::atomic<uint64_t> reserved = 0; //Producers reserve space in the ring by moving this forward...
+	std::atomic<uint64_t> published = 0; //...and publish it strictly in order, so the reader never sees a record that is still being filled
+
+	std::array<std::atomic<int>, MAX_PRIORITY+1> reserving; //How many producers of each priority are trying to reserve space
+} ShardInfo;
 
 typedef struct {
 	std::string file;
 	int fd = -1;
 	bool is_write; //Whether we will be writing to it (otherwise, we will be reading from it)
-	std::vector<SegmentInfo> segment_to_info;
 	uint8_t* mmap = NULL;
 	size_t size;
 
-	uint8_t* head;
-	uint8_t* tail;
+	std::vector<ShardInfo> shards;
 } DriveInfo;
 
 DriveInfo H2G, G2H; //Fill in path information in main()
@@ -64,15 +201,13 @@ auto SocketClose(socket_ptr& socket){
 	}
 	
 	asio::error_code ec;
-	//TODO: Maybe also do a graceful shutdown with ->shutdown()?
+	socket->shutdown(asio::socket_base::shutdown_both, ec); //On Linux, close() alone doesn't wake up a thread that's blocked reading from the socket
 	socket->close(ec);
 }
 
-std::atomic<uint32_t> thread_counter = 0;
-
 asio::io_context context;
 
-std::mutex ring_mutex;
+uint32_t MAX_RECORD_PAYLOAD; //Set in main(), once the size of the ring is known
 /*
 You can't use ramdisks on macOS because mmap and pread/pwrite will fail --- since they depend on the size being non-zero. However, on macOS all disks has zero size (this is not true on Linux) --- so any offset argument has to be <= 0, which is a problem. You will take a performance hit (and may wear out the drive faster). Will try ivshmem to see if it minimizes memory copies (will need to patch QEMU, and will use mmap with msync --- can just memcpy)
 
@@ -92,221 +227,1164 @@ void flushDrive(){
 	return flushDrive(Write.get());
 }
 
-//0|1|2|3|4|5
-//T| |H|
-auto WaitForChange(std::reference_wrapper<DriveInfo>& info, std::function<bool(uint8_t,uint8_t)> f){
+enum WaitStrategy{
+	WAIT_SLEEP, //Poll every 10us. Cheap, but every hop pays for the timer slack.
+	WAIT_SPIN, //Poll without ever giving up the core. Lowest latency, but each waiting thread uses a whole core (see CONN_SERVER_SPIN_CPU).
+	WAIT_ADAPTIVE //Spin for a bit, then yield, then sleep with an exponential backoff
+};
+
+WaitStrategy parseWaitStrategy(std::string name){
+	if (name == "sleep"){
+		return WAIT_SLEEP;
+	}else if (name == "spin"){
+		return WAIT_SPIN;
+	}else if (name != "adaptive"){
+		fprintf(stderr, "Unknown wait strategy %s, using adaptive\n", name.c_str());
+	}
+	return WAIT_ADAPTIVE;
+}
+
+WaitStrategy WAIT_STRATEGY = parseWaitStrategy(getEnv("CONN_SERVER_WAIT_STRATEGY", "adaptive"));
+int SPIN_ITERATIONS = getEnv("CONN_SERVER_SPIN_ITERATIONS", std::thread::hardware_concurrency() > 1 ? 2000 : 0); //For WAIT_ADAPTIVE. Spinning on a single core only delays whoever we're waiting for.
+int YIELD_ITERATIONS = getEnv("CONN_SERVER_YIELD_ITERATIONS", 50);
+int MAX_SLEEP = getEnv("CONN_SERVER_MAX_SLEEP_US", 500);
+int SPIN_CPU = getEnv("CONN_SERVER_SPIN_CPU", -1); //For WAIT_SPIN, the core that the ring reader is pinned to (-1 to not pin)
+int WAIT_STATS_INTERVAL = getEnv("CONN_SERVER_WAIT_STATS", 0); //How often (in seconds) to print the counters below (0 to never)
+
+typedef struct { //How many waits ended in each phase, and how long they took in all
+	std::atomic<uint64_t> count = 0;
+	std::atomic<uint64_t> nanoseconds = 0;
+} WaitCounter;
+
+WaitCounter spin_waits, yield_waits, sleep_waits;
+
+struct WaitTimer{
+	WaitCounter* counter; //Moved along as the wait goes from one phase to the next, so only the one it ends in is counted
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	~WaitTimer(){
+		counter->count++;
+		counter->nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+};
+
+void cpuRelax(){ //Tells the core that we're spinning, so it can save power (and let the other hyperthread run)
+	#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+	#elif defined(__aarch64__)
+		asm volatile("yield");
+	#endif
+}
+
+void pinThread(int cpu){
+	if (cpu < 0){
+		return;
+	}
+	#ifdef __linux__ //macOS doesn't let you pin threads
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	#endif
+}
+
+void reportWaits(){
 	for(;;){
-		auto head = *info.get().head;
-		auto tail = *info.get().tail;
-		if(f(head,tail)){
-			return std::make_tuple(head, tail, f);
+		std::this_thread::sleep_for(std::chrono::seconds(WAIT_STATS_INTERVAL));
+		for(auto [name, counter]: {std::make_pair("spin", &spin_waits), std::make_pair("yield", &yield_waits), std::make_pair("sleep", &sleep_waits)}){
+			fprintf(stderr, "%s: %llu waits, %.3f ms\n", name, (unsigned long long)counter->count.load(), counter->nanoseconds.load()/1e6);
 		}
+	}
+}
 
-		usleep(10);
+//0|1|2|3|4|5
+//T| |H|
+auto WaitForChange(ShardInfo& shard, std::function<bool(uint64_t,uint64_t)> f){
+	uint64_t head, tail;
+	auto changed = [&](){ //The other side writes these from another process, so they have to be re-read every time
+		head = std::atomic_ref(*shard.head).load(std::memory_order_acquire);
+		tail = std::atomic_ref(*shard.tail).load(std::memory_order_acquire);
+		return f(head, tail);
+	};
+
+	if (changed()){
+		return std::make_tuple(head, tail, f);
 	}
+
+	switch(WAIT_STRATEGY){
+		case(WAIT_SLEEP):
+			{
+			WaitTimer timer{&sleep_waits};
+			while(!changed()){
+				usleep(10);
+			}
+			break;
+			}
+		case(WAIT_SPIN):
+			{
+			WaitTimer timer{&spin_waits};
+			while(!changed()){
+				cpuRelax();
+			}
+			break;
+			}
+		case(WAIT_ADAPTIVE):
+			{
+			WaitTimer timer{&spin_waits};
+			for(int i = 0; i < SPIN_ITERATIONS; i++){
+				if (changed()){
+					return std::make_tuple(head, tail, f);
+				}
+				cpuRelax();
+			}
+			timer.counter = &yield_waits;
+			for(int i = 0; i < YIELD_ITERATIONS; i++){
+				if (changed()){
+					return std::make_tuple(head, tail, f);
+				}
+				std::this_thread::yield();
+			}
+			timer.counter = &sleep_waits;
+			for(int delay = 1; !changed(); delay = std::min(delay*2, MAX_SLEEP)){
+				usleep(delay);
+			}
+			break;
+			}
+	}
+	return std::make_tuple(head, tail, f);
 }
 
 
-void writeToRing(uint32_t thread, MessageType msg_type, uint32_t arg1, socket_type* conn = NULL, uint32_t count = 0){
-	std::unique_lock lk(ring_mutex);
-	
-	auto mem = Write.get().mmap;
-	auto& segments = Write.get().segment_to_info;
+bool higherReserving(ShardInfo& shard, int priority){
+	for(int i = priority + 1; i <= MAX_PRIORITY; i++){
+		if (shard.reserving[i] > 0){
+			return true;
+		}
+	}
+	return false;
+}
+
+bool canReserve(ShardInfo& shard, uint64_t head, uint64_t size, int priority, uint64_t& start, uint64_t& end){ //Whether a record of size fits in front of head right now, and where
+	auto ring_size = shard.size;
+	auto limit = ring_size - (MAX_PRIORITY - priority)*(ring_size/PRIORITY_HEADROOM);
+	start = shard.reserved.load(); //Has to be re-read every time, since the reader can get past a stale one
+	auto offset = start % ring_size;
+	end = (offset + size > ring_size) ? start + (ring_size - offset) + size : start + size; //Skip to the start of the ring if it doesn't fit
+	return end - head <= limit && !higherReserving(shard, priority);
+}
 
+std::tuple<uint64_t, uint64_t> reserveRecord(ShardInfo& shard, uint64_t size, int priority){ //Lock-free: only ever waits for the reader to make room. Returns where the reservation starts and ends (the record is at the end of it).
+	uint64_t start, end;
+
+	shard.reserving[priority]++;
 	for(;;){
-		auto [ head, tail, f ] = WaitForChange(Write, [](uint8_t a, uint8_t b){ return b!=(a-1);}); //Wait until the tail (which points to the index after the last filled element) is one place before the head.
+		WaitForChange(shard, [&](uint64_t head, uint64_t){
+			return canReserve(shard, head, size, priority, start, end);
+		});
 
-		while(f(head,tail)){
-			auto offset = segments[tail].offset;
+		if (shard.reserved.compare_exchange_weak(start, end)){
+			shard.reserving[priority]--;
+			return {start, end};
+		}
+	}
+}
 
-			auto size = segments[tail].size;
+std::optional<std::tuple<uint64_t, uint64_t>> tryReserveRecord(ShardInfo& shard, uint64_t size, int priority){ //Same, but gives up instead of waiting for the reader. Whoever keeps retrying has to count itself in shard.reserving meanwhile, so lower priorities still keep out of its way.
+	uint64_t start, end;
+	for(;;){
+		auto head = std::atomic_ref(*shard.head).load(std::memory_order_acquire);
+		if (!canReserve(shard, head, size, priority, start, end)){
+			return std::nullopt;
+		}
+		if (shard.reserved.compare_exchange_weak(start, end)){
+			return std::make_tuple(start, end);
+		}
+	}
+}
 
-			auto written = std::min(size - 12, count); //How much data to write
-			if(count > 0){ //There's data to write --- any call to write data should be separate from the call to write a control message
+void publishRecord(ShardInfo& shard, uint64_t start, uint64_t end){
+	auto current = shard.published.load(std::memory_order_acquire);
+	while(current != start){ //The producers before us only have a copy left, so this is short
+		shard.published.wait(current);
+		current = shard.published.load(std::memory_order_acquire);
+	}
 
-				msg_type = DATA;
-				arg1 = written;
-			}
+	flushDrive();
+	std::atomic_ref(*shard.tail).store(end, std::memory_order_release);
+	flushDrive();
 
-			packMessage(mem+offset, thread, msg_type, arg1);
+	shard.published.store(end, std::memory_order_release);
+	shard.published.notify_all();
+}
 
+void writeHeader(uint8_t* record, uint32_t thread, uint32_t msg_type, uint32_t arg1){ //Of a record with no payload (or one that's read in separately)
+	if (uncached_ring){
+		alignas(RECORD_ALIGN) uint8_t header[RECORD_ALIGN] = {};
+		packMessage(header, thread, msg_type, arg1);
+		copyToRing(record, header, sizeof(header));
+	}else{
+		packMessage(record, thread, msg_type, arg1);
+	}
+}
 
-			if(conn != NULL){
-				asio::read(*conn, asio::buffer(mem+offset+12, written));
-			}
+void writeRecord(ShardInfo& shard, uint64_t start, uint64_t end, uint32_t thread, MessageType msg_type, uint32_t arg1, socket_type* conn = NULL, const uint8_t* data = NULL){ //Fills in a reservation and publishes it. A DATA record's arg1 bytes come from conn, unless they're already in memory.
+	auto ring = shard.ring;
+	auto ring_size = shard.size;
+	auto written = (msg_type == DATA) ? arg1 : 0;
+	auto size = recordSize(written);
 
-			count -= written;
-			
-			flushDrive();
-			*(Write.get().tail)=(++tail);
-			flushDrive();
-			
-			if(count == 0){
-				return;
+	if (end - start > size){ //Didn't fit before the end of the ring
+		writeHeader(ring + start % ring_size, thread, PADDING, 0);
+	}
+	auto record = ring + (end - size) % ring_size;
+
+	asio::error_code ec; //If conn fails, the record is turned into PADDING, since the reservation still has to be published (every record after it waits for that)
+	if (uncached_ring && written > 0){
+		thread_local std::vector<uint8_t> staging; //So the whole record can be copied in at once
+		staging.resize(size);
+		packMessage(staging.data(), thread, msg_type, arg1);
+		if (data != NULL){
+			memcpy(staging.data()+12, data, written);
+		}else{
+			asio::read(*conn, asio::buffer(staging.data()+12, written), ec);
+		}
+		if (ec){
+			writeHeader(record, thread, PADDING, written);
+		}else{
+			copyToRing(record, staging.data(), size);
+		}
+	}else{
+		writeHeader(record, thread, msg_type, arg1);
+		if (data != NULL){
+			memcpy(record+12, data, written);
+		}else if (written > 0){ //Already in the kernel's buffer, so this is just a copy
+			asio::read(*conn, asio::buffer(record+12, written), ec);
+			if (ec){
+				writeHeader(record, thread, PADDING, written);
 			}
 		}
 	}
+
+	publishRecord(shard, start, end);
+	if (ec){
+		throw asio::system_error(ec);
+	}
 }
 
-typedef struct ThreadInfo{
+void writeToRing(uint32_t thread, MessageType msg_type, uint32_t arg1){ //For control messages, and only called by writeControl, since it waits for room. Data goes through tryWriteToRing instead.
+	auto& shard = Write.get().shards[(thread & SLOT_MASK) % NUM_SHARDS]; //Everything for a connection goes through the same shard, so it stays in order. By slot, so one that reuses it can't get ahead of the DISCONNECT of the one before.
+	auto [start, end] = reserveRecord(shard, recordSize(0), MAX_PRIORITY);
+	writeRecord(shard, start, end, thread, msg_type, arg1);
+}
+
+int WORKERS = getEnv("CONN_SERVER_WORKERS", 4); //Run every socket operation (accepting, reading into the ring, and writing out of it)
+size_t QUEUE_LIMIT = getEnv("CONN_SERVER_QUEUE_LIMIT", 4*1024*1024); //Per connection. Past this, the other side is asked to stop sending on it until half of it has been written out.
+uint32_t MAX_SHM_SIZE = getEnv("CONN_SERVER_MAX_SHM_SIZE", 16*1024*1024); //Caps what a client can ask for (see BackendInfo::shm_size)
+
+/*
+Everything that's queued for a connection goes out in one gathered write, so a large message is a few syscalls instead of one per record. When the write is at least ZEROCOPY_MIN bytes, and the kernel lets the socket use MSG_ZEROCOPY (Linux, TCP), the kernel sends straight from our buffers. They are then kept around until it says it's done with them.
+*/
+#define MAX_GATHER 64 //What asio sends in one go anyway
+bool ZEROCOPY = getEnv("CONN_SERVER_ZEROCOPY", 1);
+size_t ZEROCOPY_MIN = getEnv("CONN_SERVER_ZEROCOPY_MIN", 64*1024); //Below this, pinning the pages costs more than copying them
+
+void releaseId(uint32_t id);
+void sendControl(uint32_t thread, MessageType msg_type, uint32_t arg1 = 0, std::function<void()> then = nullptr);
+
+typedef struct ThreadInfo : std::enable_shared_from_this<ThreadInfo>{
 	socket_ptr conn = NULL;
 	uint32_t thread;
-	std::atomic<bool> connected = false;
+	std::atomic<bool> confirming = false; //Waiting for the other side to confirm a CONNECT, before reading anything else from conn
+	int priority = MAX_PRIORITY; //Of the backend, once it's known
+	std::array<uint8_t, 12> message_buf; //For reading from conn
+	uint32_t write_high = 0; //From a WRITE_HIGH, for the WRITE right after it
+
+	uint32_t message_size = 0, message_high = 0; //Of the message being read from conn...
+	int headers_left = 0; //...and how many of its WRITE_HIGH/WRITE records are still to be written (see startWrite)
+	std::deque<std::pair<uint64_t, uint64_t>> ring_in_flight; //<end, size> of each of our DATA records that the reader hasn't gotten past yet
+	uint64_t ring_in_flight_size = 0;
+	bool ring_reserving = false; //Counted in its shard's reserving while it waits for room
+	int ring_backoff = 0; //Microseconds until it tries again (see waitForRing)
+
+	ShmRegion shm; //Replaces conn for everything after the CONFIRM, if the client asked for it (see startShm)
+	uint32_t shm_size = 0; //What it asked for
+	uint32_t shm_header = 0; //How much of the next message's header has been read into message_buf
+	uint64_t shm_remaining = 0; //How much of the current WRITE is left to read
+	size_t shm_sent = 0; //How much of the front of outbound has been written
+	std::atomic<bool> shm_reading = false; //Waiting for the client to write...
+	std::atomic<bool> shm_sending = false; //...or to read
+	std::atomic<bool> shm_closed = false; //conn is gone, so what's left in shm is all there is
+	std::array<uint8_t, 64> wake_buf;
+
+	std::mutex pause_mu; //Guards paused and resume
+	bool paused = false; //The other side asked us to stop reading from conn...
+	std::function<void()> resume; //...so the next read waits here until it says to go on
+
+	std::mutex out_mu; //Guards everything below
+	std::deque<std::vector<uint8_t>> outbound; //Copied out of the ring, waiting to be written to conn. An empty entry means conn should be closed once everything before it is written.
+	size_t queued = 0; //Bytes in outbound
+	bool sending = false; //Whether the front of outbound is being written
+	bool paused_peer = false; //We asked the other side to stop sending on this connection
+	size_t in_flight = 0; //How many entries at the front of outbound are being written
+
+	bool zerocopy = false; //Whether conn takes MSG_ZEROCOPY (turned off if the kernel ends up copying anyway)
+	uint32_t zerocopy_next = 0; //Sequence number of the next MSG_ZEROCOPY send
+	uint32_t zerocopy_done = 0; //Every send before this one has been completed
+	std::deque<std::pair<uint32_t, std::vector<uint8_t>>> zerocopy_pending; //Entries the kernel may still be sending from, with the last send that used them
+	bool zerocopy_watching = false;
 
 	~ThreadInfo(){
-		writeToRing(thread, DISCONNECT, 0);
+		if (ring_reserving){
+			Write.get().shards[(thread & SLOT_MASK) % NUM_SHARDS].reserving[priority]--;
+		}
 		SocketClose(conn);
-		thread_counter--;
+		shmUnmap(shm);
+		sendControl(thread, DISCONNECT, 0, [thread = thread](){
+			releaseId(thread); //Only now, so the DISCONNECT is in the ring before a CONNECT that reuses its slot
+		});
 	}
 } ThreadInfo;
 
-std::unordered_map<uint32_t, std::shared_ptr<ThreadInfo>> thread_to_info; //Map the client thread id to the corresponding thread. We use the client server thread number globally for both server and client (works as long as there is a 1-to-1 relationship between a client and server, and that upon disconnection on either side, we completely restart (ie, re-exec) the corresponding side).
+bool tryWriteToRing(ThreadInfo* info, MessageType msg_type, uint32_t arg1, socket_type* conn = NULL, const uint8_t* data = NULL){ //For a connection's own messages, which are written from its handlers, so this never waits: it writes one record, or nothing if the ring (or the connection's credit) is full
+	auto& shard = Write.get().shards[(info->thread & SLOT_MASK) % NUM_SHARDS];
+	auto size = recordSize(msg_type == DATA ? arg1 : 0);
 
-std::shared_mutex t2i_mutex;
+	if (msg_type == DATA){ //Only the connection's own handlers write its data, so its credits can be kept on it
+		auto head = std::atomic_ref(*shard.head).load(std::memory_order_acquire);
+		while(!info->ring_in_flight.empty() && info->ring_in_flight.front().first <= head){
+			info->ring_in_flight_size -= info->ring_in_flight.front().second;
+			info->ring_in_flight.pop_front();
+		}
+		if (!info->ring_in_flight.empty() && info->ring_in_flight_size + size > CREDIT){ //Always let one through, in case a record is bigger than CREDIT
+			return false;
+		}
+	}
 
-std::condition_variable_any t2i_delete_cv;
+	if (!info->ring_reserving){
+		shard.reserving[info->priority]++;
+		info->ring_reserving = true;
+	}
+	auto reservation = tryReserveRecord(shard, size, info->priority);
+	if (!reservation){
+		return false;
+	}
+	shard.reserving[info->priority]--;
+	info->ring_reserving = false;
+	info->ring_backoff = 0;
+
+	auto [start, end] = *reservation;
+	if (msg_type == DATA){
+		info->ring_in_flight.emplace_back(end, size);
+		info->ring_in_flight_size += size;
+	}
+	writeRecord(shard, start, end, info->thread, msg_type, arg1, conn, data);
+	return true;
+}
 
-void HandleConn(int key, std::shared_ptr<ThreadInfo> info){ //Read from socket and write to ring
-//When quitting, remove from dictionary
-	std::array<uint8_t, 12> message_buf;
+/*
+Connections are found by id in a flat table, so the ring readers can dispatch a record with one array index and no locks. The guest hands out ids (the host uses whatever the guest sent): the low SLOT_BITS are the slot, and the rest is a generation that goes up every time the slot is reused, so a record for a connection that's gone never reaches the one that took its place.
+The readers only hold raw pointers, so a removed connection is retired instead of being let go of right away. Each reader publishes the epoch it started its current batch in (0 when it isn't in one), and a retired connection is only let go of once every reader that could have seen it has finished its batch.
+*/
 
-	try {
-		for (;;){
-			auto [ msg_type, arg1, arg2 ] = readFromConn(*info->conn, message_buf);
-			//printf("Message type: %i\n", msg_type);
-			switch (msg_type){
+typedef struct {
+	std::atomic<ThreadInfo*> info = NULL; //What the readers look at...
+	std::shared_ptr<ThreadInfo> owner; //...while this keeps it alive
+} ConnSlot;
+
+std::unique_ptr<ConnSlot[]> slots(new ConnSlot[SLOT_MASK + 1]);
+std::mutex table_mu; //Guards everything below. Lookups never take it.
+std::vector<uint32_t> generations(SLOT_MASK + 1);
+std::vector<uint32_t> free_slots;
+uint32_t next_slot = 0; //Slots past this have never been used
+
+std::atomic<uint64_t> epoch = 1;
+std::unique_ptr<std::atomic<uint64_t>[]> reader_epochs(new std::atomic<uint64_t>[NUM_SHARDS]()); //One per ring reader
+std::deque<std::pair<uint64_t, std::shared_ptr<ThreadInfo>>> retired; //With the epoch they were retired in
+std::atomic<size_t> retired_count = 0;
+
+ThreadInfo* findConn(uint32_t id){ //Only valid until the end of the reader's batch
+	auto info = slots[id & SLOT_MASK].info.load(); //seq_cst, so it can't be moved ahead of the reader publishing its epoch (reclaim could miss that otherwise)
+	return (info != NULL && info->thread == id) ? info : NULL;
+}
 
-				case (CONNECT): //Guest wants to connect to host. Therefore, this will only ever be run by the guest.
-				{
-					auto backend = arg1;
-					writeToRing(info->thread, CONNECT, backend);
-						info->connected.wait(false); //Atomic variable, waiting for an update
-						writeToConn(*info->conn, message_buf, CONFIRM, 0, 0); //Tell UNIX socket that we've connected
-					break;		
+void retire(std::shared_ptr<ThreadInfo> info){ //table_mu must be held
+	retired.emplace_back(epoch.fetch_add(1), std::move(info));
+	retired_count++;
+}
+
+void reclaim(){ //Lets go of the retired connections no reader can still be looking at
+	std::deque<std::shared_ptr<ThreadInfo>> done; //Let go of on a worker, since that may be the last reference, and ~ThreadInfo writes to the ring
+	{
+	std::scoped_lock lk(table_mu);
+	auto oldest = UINT64_MAX;
+	for(int i = 0; i < NUM_SHARDS; i++){
+		auto reader_epoch = reader_epochs[i].load();
+		if (reader_epoch != 0){
+			oldest = std::min(oldest, reader_epoch);
+		}
+	}
+	while(!retired.empty() && retired.front().first < oldest){
+		done.push_back(std::move(retired.front().second));
+		retired.pop_front();
+		retired_count--;
+	}
+	}
+	if (!done.empty()){
+		asio::post(context, [done = std::move(done)]() mutable {
+			done.clear();
+		});
+	}
+}
+
+void addConn(std::shared_ptr<ThreadInfo> info){ //Only replaces a connection from inside a reader's batch, which reclaims it once the batch is done
+	std::scoped_lock lk(table_mu);
+	auto& slot = slots[info->thread & SLOT_MASK];
+	if (slot.owner){ //The host can get a CONNECT for a slot before it's done with the connection that had it
+		retire(std::move(slot.owner));
+	}
+	slot.info.store(info.get(), std::memory_order_release);
+	slot.owner = std::move(info);
+}
+
+void removeConn(ThreadInfo* info){
+	{
+	std::scoped_lock lk(table_mu);
+	auto& slot = slots[info->thread & SLOT_MASK];
+	if (slot.info.load() != info){ //A new connection may have already taken the slot
+		return;
+	}
+	slot.info.store(NULL);
+	retire(std::move(slot.owner));
+	}
+	reclaim(); //The readers only reclaim at the end of a batch, so this can't wait for one if the rings are idle
+}
+
+uint32_t allocateId(){ //Guest only. Returns UINT32_MAX if every slot is taken.
+	std::scoped_lock lk(table_mu);
+	uint32_t slot;
+	if (!free_slots.empty()){
+		slot = free_slots.back();
+		free_slots.pop_back();
+	}else if (next_slot <= SLOT_MASK){
+		slot = next_slot++;
+	}else{
+		return UINT32_MAX;
+	}
+	auto id = (++generations[slot] << SLOT_BITS) | slot;
+	return id == UINT32_MAX ? (++generations[slot] << SLOT_BITS) | slot : id;
+}
+
+void releaseId(uint32_t id){
+	if (!is_guest){ //The guest's ids, so it's the only one who hands them out
+		return;
+	}
+	std::scoped_lock lk(table_mu);
+	free_slots.push_back(id & SLOT_MASK);
+}
+
+std::mutex control_mu;
+std::condition_variable control_cv;
+std::deque<std::tuple<uint32_t, MessageType, uint32_t, std::function<void()>>> control_queue; //CONNECT, CONFIRM, DISCONNECT, PAUSE and RESUME messages, which are written to the ring by their own thread, so whoever sends one (usually a worker) never has to wait for space in the ring
+
+void sendControl(uint32_t thread, MessageType msg_type, uint32_t arg1, std::function<void()> then){ //then is posted to a worker once the message is in the ring
+	std::scoped_lock lk(control_mu);
+	control_queue.emplace_back(thread, msg_type, arg1, std::move(then));
+	control_cv.notify_one();
+}
+
+void writeControl(){
+	for(;;){
+		std::unique_lock lk(control_mu);
+		control_cv.wait(lk, []{return !control_queue.empty();});
+		auto [thread, msg_type, arg1, then] = std::move(control_queue.front());
+		control_queue.pop_front();
+		lk.unlock();
+
+		writeToRing(thread, msg_type, arg1);
+		if (then){
+			asio::post(context, std::move(then));
+		}
+	}
+}
+
+void wakeConn(std::shared_ptr<ThreadInfo> info){ //For shm: the client is blocked on it
+	uint8_t byte = 0;
+	asio::error_code ec;
+	info->conn->send(asio::buffer(&byte, 1), 0, ec);
+}
+
+std::vector<uint8_t> sent(std::shared_ptr<ThreadInfo> info){ //The front of outbound is out. out_mu must be held.
+	auto data = std::move(info->outbound.front());
+	info->queued -= data.size();
+	info->outbound.pop_front();
+
+	if (info->paused_peer && info->queued <= QUEUE_LIMIT/2){
+		info->paused_peer = false;
+		sendControl(info->thread, RESUME);
+	}
+	return data;
+}
+
+void closeOutbound(std::shared_ptr<ThreadInfo> info){ //out_mu must be held
+	SocketClose(info->conn);
+	info->outbound.clear();
+	info->queued = 0;
+	info->in_flight = 0;
+}
+
+void sendNext(std::shared_ptr<ThreadInfo> info);
+
+void reapZerocopy(std::shared_ptr<ThreadInfo> info){ //Lets go of the entries the kernel is done sending. out_mu must be held.
+	#ifdef SO_EE_ORIGIN_ZEROCOPY
+		for(;;){
+			alignas(cmsghdr) char control[128];
+			msghdr msg = {};
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			if (recvmsg(info->conn->native_handle(), &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0){
+				break;
+			}
+
+			for(auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+				if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))){
+					continue;
 				}
-				case(WRITE):
-				{
-					auto size = arg1;
-					writeToRing(info->thread, WRITE, size);
-					writeToRing(info->thread, DUMMY, 0, info->conn.get(), size); //Write the data
+				sock_extended_err err;
+				memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+				if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY){
+					continue;
+				}
+				info->zerocopy_done = std::max(info->zerocopy_done, err.ee_data + 1); //Completes [ee_info, ee_data], and they come in order on TCP
+				if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED){ //Loopback, or a device that can't do it
+					info->zerocopy = false;
+				}
+			}
+		}
+	#endif
+
+	while(!info->zerocopy_pending.empty() && info->zerocopy_pending.front().first < info->zerocopy_done){
+		info->zerocopy_pending.pop_front();
+	}
+}
+
+void watchZerocopy(std::shared_ptr<ThreadInfo> info){ //Completions come in on the socket's error queue. out_mu must be held.
+	if (info->zerocopy_watching || info->zerocopy_pending.empty()){
+		return;
+	}
+	info->zerocopy_watching = true;
+	info->conn->async_wait(asio::socket_base::wait_error, [info](const asio::error_code& ec){
+		std::scoped_lock lk(info->out_mu);
+		info->zerocopy_watching = false;
+		reapZerocopy(info);
+		if (ec){
+			info->zerocopy_pending.clear(); //Closed, so the kernel has let go of them
+		}
+		watchZerocopy(info);
+
+		if (info->zerocopy_pending.empty() && info->in_flight == 0 && !info->outbound.empty() && info->outbound.front().empty()){ //A DISCONNECT was waiting on them
+			sendNext(info);
+		}
+	});
+}
+
+void sendZerocopy(std::shared_ptr<ThreadInfo> info, size_t offset){ //Sends the entries in flight with MSG_ZEROCOPY. offset is how much of the first one is already out. out_mu must be held.
+	#ifdef MSG_ZEROCOPY
+		iovec iov[MAX_GATHER];
+		size_t count = 0;
+		for(size_t i = 0; i < info->in_flight; i++){
+			auto& data = info->outbound[i];
+			iov[count++] = {data.data() + (i == 0 ? offset : 0), data.size() - (i == 0 ? offset : 0)};
+		}
+		msghdr msg = {};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+
+		auto result = sendmsg(info->conn->native_handle(), &msg, MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == EINTR)){ //ENOBUFS means too many sends are waiting to be completed
+			reapZerocopy(info);
+			info->conn->async_wait(errno == ENOBUFS ? asio::socket_base::wait_error : asio::socket_base::wait_write, [info, offset](const asio::error_code& ec){
+				std::scoped_lock lk(info->out_mu);
+				if (ec){
+					closeOutbound(info);
+					return sendNext(info);
+				}
+				sendZerocopy(info, offset);
+			});
+			return;
+		}
+		if (result < 0){
+			closeOutbound(info);
+			return sendNext(info);
+		}
+
+		auto seq = info->zerocopy_next++;
+		offset += result;
+		while(info->in_flight > 0 && offset >= info->outbound.front().size()){
+			offset -= info->outbound.front().size();
+			info->in_flight--;
+			info->zerocopy_pending.emplace_back(seq, sent(info));
+		}
+		if (info->in_flight > 0){ //The kernel's buffer filled up partway through
+			info->zerocopy_pending.emplace_back(seq, std::vector<uint8_t>()); //Keeps seq in order, the entry itself stays in outbound
+			info->conn->async_wait(asio::socket_base::wait_write, [info, offset](const asio::error_code& ec){
+				std::scoped_lock lk(info->out_mu);
+				if (ec){
+					closeOutbound(info);
+					return sendNext(info);
+				}
+				sendZerocopy(info, offset);
+			});
+			return;
+		}
+		reapZerocopy(info);
+		watchZerocopy(info);
+	#endif
+	sendNext(info);
+}
+
+void sendNext(std::shared_ptr<ThreadInfo> info){ //out_mu must be held
+	while(!info->outbound.empty()){
+		info->sending = true;
+
+		auto& data = info->outbound.front();
+		if (data.empty()){ //DISCONNECT
+			if (!info->zerocopy_pending.empty()){ //The kernel still has to send those, so closing now would lose them (see watchZerocopy)
+				return watchZerocopy(info);
+			}
+			closeOutbound(info);
+			info->sending = false;
+			return;
+		}
+
+		if (info->shm.map == NULL){
+			std::vector<asio::const_buffer> buffers;
+			size_t size = 0;
+			for(auto& entry: info->outbound){ //Everything up to a DISCONNECT goes out together
+				if (entry.empty() || buffers.size() == MAX_GATHER){
 					break;
 				}
+				buffers.push_back(asio::buffer(entry));
+				size += entry.size();
+			}
+			info->in_flight = buffers.size();
 
-				default:
-					{
-						printf("This is not supposed to happen!\n");
-						break;
+			if (info->zerocopy && size >= ZEROCOPY_MIN){
+				return sendZerocopy(info, 0);
+			}
+			asio::async_write(*info->conn, buffers, [info](const asio::error_code& ec, size_t){
+				std::scoped_lock lk(info->out_mu);
+				for(; info->in_flight > 0; info->in_flight--){
+					sent(info);
+				}
+
+				if (ec){ //The connection is gone, so there's no point in sending the rest
+					closeOutbound(info);
+				}
+				sendNext(info);
+			});
+			return;
+		}
+
+		auto& ring = info->shm.to_client;
+		info->shm_sent += shmWrite(ring, data.data() + info->shm_sent, data.size() - info->shm_sent);
+		if (shmShouldWake(ring)){
+			wakeConn(info);
+		}
+		if (info->shm_sent < data.size()){ //Full, so pick up from here once the client has read some of it (see watchShm)
+			info->shm_sending = true;
+			if (shmWait(ring, true) || !info->shm_sending.exchange(false)){
+				return;
+			}
+			continue;
+		}
+		info->shm_sent = 0;
+		sent(info);
+	}
+	info->sending = false;
+}
+
+void flushConn(ThreadInfo* info){ //Starts sending whatever enqueue was told to hold on to
+	std::scoped_lock lk(info->out_mu);
+	if (!info->sending){
+		sendNext(info->shared_from_this());
+	}
+}
+
+void enqueue(ThreadInfo* info, const uint8_t* data, size_t size, bool hold = false){ //Copies data out of the ring, so its space can be reused right away. If hold is set, it waits for flushConn, so more can be gathered into the same write.
+	std::scoped_lock lk(info->out_mu);
+	info->outbound.emplace_back(data, data+size);
+	info->queued += size;
+
+	if (!info->paused_peer && info->queued > QUEUE_LIMIT){
+		info->paused_peer = true;
+		sendControl(info->thread, PAUSE);
+	}
+	if (!info->sending && !hold){
+		sendNext(info->shared_from_this());
+	}
+}
+
+void closeConn(std::shared_ptr<ThreadInfo> info){ //Once the last reference is dropped, the other side is told to disconnect
+	removeConn(info.get());
+}
+
+bool parked(std::shared_ptr<ThreadInfo> info, std::function<void()> f){ //Only this connection waits for the other side to catch up. Returns whether f will be run once it has.
+	std::scoped_lock lk(info->pause_mu);
+	if (info->paused){
+		info->resume = std::move(f);
+		return true;
+	}
+	return false;
+}
+
+void whenUnpaused(std::shared_ptr<ThreadInfo> info, std::function<void()> f){
+	if (!parked(info, f)){
+		f();
+	}
+}
+
+void unpause(std::shared_ptr<ThreadInfo> info){
+	std::unique_lock lk(info->pause_mu);
+	info->paused = false;
+	auto resume = std::move(info->resume);
+	info->resume = nullptr;
+	lk.unlock();
+
+	if (resume){
+		asio::post(context, resume);
+	}
+}
+
+void readMessage(std::shared_ptr<ThreadInfo> info);
+
+int peekConn(std::shared_ptr<ThreadInfo> info){ //Readiness can be stale, so look without blocking: >0 if there's data, 0 if the other end is gone, -1 if there's nothing yet
+	uint8_t byte;
+	auto result = recv(info->conn->native_handle(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+		return -1;
+	}
+	return std::max<int>(result, 0);
+}
+
+void waitForRing(std::shared_ptr<ThreadInfo> info, std::function<void()> f){ //The ring (or the connection's credit) is full. Rather than hold up a worker until the reader makes room, f is tried again a little later.
+	info->ring_backoff = std::min(std::max(info->ring_backoff*2, 10), MAX_SLEEP);
+	auto timer = std::make_shared<asio::steady_timer>(context, std::chrono::microseconds(info->ring_backoff));
+	timer->async_wait([timer, f](const asio::error_code&){
+		f();
+	});
+}
+
+void beginWrite(ThreadInfo* info, uint32_t size, uint32_t high){ //A message of (high << 32) | size bytes is coming
+	info->message_size = size;
+	info->message_high = high;
+	info->headers_left = (high != 0) ? 2 : 1; //Records only have room for 32 bits
+}
+
+bool startWrite(ThreadInfo* info){ //Tells the other side about the message from beginWrite. Returns false if the ring is full, in which case it has to be called again.
+	if (info->headers_left == 2){
+		if (!tryWriteToRing(info, WRITE_HIGH, info->message_high)){
+			return false;
+		}
+		info->headers_left = 1;
+	}
+	if (info->headers_left == 1){
+		if (!tryWriteToRing(info, WRITE, info->message_size)){
+			return false;
+		}
+		info->headers_left = 0;
+	}
+	return true;
+}
+
+void readData(std::shared_ptr<ThreadInfo> info, uint64_t remaining){ //Moves the payload of a WRITE into the ring as it arrives, a piece at a time, so nothing ever blocks on the socket or the ring
+	try{
+		if (!startWrite(info.get())){
+			return waitForRing(info, [info, remaining](){ readData(info, remaining); });
+		}
+		while(remaining > 0){
+			auto available = std::min<size_t>({info->conn->available(), remaining, MAX_RECORD_PAYLOAD});
+			if (available == 0){
+				info->conn->async_wait(asio::socket_base::wait_read, [info, remaining](const asio::error_code& ec){
+					if (ec || peekConn(info) == 0){
+						return closeConn(info);
 					}
+					whenUnpaused(info, [info, remaining](){ readData(info, remaining); });
+				});
+				return;
+			}
+
+			if (!tryWriteToRing(info.get(), DATA, available, info->conn.get())){ //Write the data
+				return waitForRing(info, [info, remaining](){ readData(info, remaining); });
+			}
+			remaining -= available;
+		}
+	}
+	catch (asio::system_error&){
+		return closeConn(info);
+	}
+
+	whenUnpaused(info, [info](){ readMessage(info); });
+}
+
+void readMessage(std::shared_ptr<ThreadInfo> info){ //Read from socket and write to ring
+	asio::async_read(*info->conn, asio::buffer(info->message_buf), [info](const asio::error_code& ec, size_t){
+		if (ec){
+			return closeConn(info);
+		}
+
+		auto [ msg_type, arg1, arg2 ] = unpackMessage(info->message_buf.data());
+		//printf("Message type: %i\n", msg_type);
+		switch (msg_type){
+
+			case (CONNECT): //Guest wants to connect to host. Therefore, this will only ever be run by the guest.
+			{
+				auto backend = arg1;
+				info->priority = getBackend(backend)->priority;
+				info->shm_size = std::min(arg2, MAX_SHM_SIZE);
+				info->confirming = true;
+				sendControl(info->thread, CONNECT, backend);
+				return; //Reading continues once the host confirms
+			}
+			case(WRITE):
+			{
+				beginWrite(info.get(), arg1, arg2);
+				return readData(info, arg1 | (uint64_t(arg2) << 32));
+			}
+
+			default:
+				{
+					printf("This is not supposed to happen!\n");
+					break;
+				}
+
+		}
+		whenUnpaused(info, [info](){ readMessage(info); });
+	});
+}
+
+void readShm(std::shared_ptr<ThreadInfo> info){ //Same as readMessage and readData, but from the shared memory the client writes to
+	auto& ring = info->shm.to_server;
+	for(;;){
+		if (!startWrite(info.get())){
+			return waitForRing(info, [info](){ readShm(info); });
+		}
+
+		auto [data, available] = shmPeek(ring);
+		if (available == 0){
+			info->shm_reading = true;
+			if (shmWait(ring, false) && !info->shm_closed){ //watchShm picks it up from here
+				return;
+			}
+			if (!info->shm_reading.exchange(false)){ //watchShm already did
+				return;
+			}
+			std::tie(data, available) = shmPeek(ring);
+			if (available == 0){ //Closed, and everything it sent has been read
+				return closeConn(info);
+			}
+		}
 
+		if (info->shm_remaining == 0){
+			auto size = std::min<size_t>(available, info->message_buf.size() - info->shm_header);
+			memcpy(info->message_buf.data() + info->shm_header, data, size);
+			shmConsume(ring, size);
+			info->shm_header += size;
+			if (info->shm_header < info->message_buf.size()){
+				continue;
+			}
+			info->shm_header = 0;
+
+			auto [ msg_type, arg1, arg2 ] = unpackMessage(info->message_buf.data());
+			if (msg_type == WRITE){
+				beginWrite(info.get(), arg1, arg2);
+				info->shm_remaining = arg1 | (uint64_t(arg2) << 32);
+			}else{
+				printf("This is not supposed to happen!\n");
+			}
+		}else{
+			auto size = std::min<size_t>({available, info->shm_remaining, MAX_RECORD_PAYLOAD});
+			if (!tryWriteToRing(info.get(), DATA, size, NULL, data)){ //Write the data
+				return waitForRing(info, [info](){ readShm(info); });
 			}
+			shmConsume(ring, size);
+			info->shm_remaining -= size;
+		}
+
+		if (shmShouldWake(ring)){
+			wakeConn(info);
+		}
+		if (info->shm_remaining == 0 && parked(info, [info](){ readShm(info); })){
+			return;
 		}
 	}
+}
+
+void watchShm(std::shared_ptr<ThreadInfo> info){ //conn only carries wakeups now
+	info->conn->async_read_some(asio::buffer(info->wake_buf), [info](const asio::error_code& ec, size_t){
+		if (ec){
+			info->shm_closed = true;
+		}
+		if (info->shm_sending.exchange(false)){
+			std::scoped_lock lk(info->out_mu);
+			sendNext(info);
+		}
+		if (info->shm_reading.exchange(false)){
+			readShm(info);
+		}
+		if (!ec){
+			watchShm(info);
+		}
+	});
+}
 
+void startShm(std::shared_ptr<ThreadInfo> info){ //Confirms the connection, handing the client shared memory to use instead of conn from now on
+	std::array<uint8_t, 12> message_buf;
+	auto fd = shmCreate(info->shm_size);
+	if (fd >= 0 && !shmMap(fd, info->shm_size, info->shm)){
+		close(fd);
+		fd = -1;
+	}
+
+	try{
+		writeWithFd(*info->conn, message_buf, CONFIRM, fd >= 0 ? info->shm_size : 0, 0, fd); //Nothing else has been sent yet, so this doesn't have to be queued
+	}
 	catch (asio::system_error&){
-		t2i_mutex.lock();
-		thread_to_info.erase(key);
-		t2i_delete_cv.notify_all();
-		t2i_mutex.unlock();
+		shmUnmap(info->shm);
+	}
+	if (fd >= 0){
+		close(fd);
+	}
+	{
+		std::scoped_lock lk(info->out_mu);
+		sendNext(info); //Whatever came in while this was being set up
+	}
 
+	if (info->shm.map == NULL){
+		return readMessage(info);
 	}
+	watchShm(info);
+	readShm(info);
+}
 
+void connectBackend(std::shared_ptr<ThreadInfo> info, BackendInfo* backend, int attempt){ //Host only. Replies to the CONNECT with CONFIRM once connected, or DISCONNECT once it has given up.
+	auto retry = [info, backend, attempt](){
+		forgetEndpoints(backend);
+		if (attempt + 1 >= CONNECT_RETRIES){
+			printf("Couldn't connect to %s:%i\n", backend->address.c_str(), backend->port);
+			return closeConn(info);
+		}
+		auto timer = std::make_shared<asio::steady_timer>(context, connectBackoff(attempt));
+		timer->async_wait([info, backend, attempt, timer](const asio::error_code&){
+			connectBackend(info, backend, attempt + 1);
+		});
+	};
 
+	std::vector<ip::tcp::endpoint> endpoints;
+	{
+	std::scoped_lock lk(backend->mu);
+	endpoints = backend->endpoints;
+	}
+	if (endpoints.empty()){ //Only looked up the first time (or when none of them worked)
+		auto resolver = std::make_shared<ip::tcp::resolver>(context);
+		resolver->async_resolve(backend->address, std::to_string(backend->port), [info, backend, attempt, resolver, retry](const asio::error_code& ec, ip::tcp::resolver::results_type results){
+			if (ec || results.empty()){
+				return retry();
+			}
+			{
+			std::scoped_lock lk(backend->mu);
+			backend->endpoints.clear();
+			for(auto& result: results){
+				backend->endpoints.push_back(result.endpoint());
+			}
+			}
+			connectBackend(info, backend, attempt);
+		});
+		return;
+	}
+
+	info->conn = std::make_unique<socket_type>(context, TCP);
+	asio::async_connect(*info->conn, endpoints, [info, retry](const asio::error_code& ec, const auto&){
+		if (ec){
+			return retry();
+		}
+
+		asio::error_code ignored;
+		info->conn->set_option(asio::ip::tcp::no_delay(true), ignored);
+		#ifdef SO_ZEROCOPY
+			int one = 1;
+			info->zerocopy = ZEROCOPY && setsockopt(info->conn->native_handle(), SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+		#endif
+
+		sendControl(info->thread, CONFIRM, 0, [info](){
+			readMessage(info); //Only once the CONFIRM is in the ring, so nothing read from conn can get ahead of it
+		});
+	});
 }
 
-void readFromRing(){
-	auto mem = Read.get().mmap;
+void readFromRing(int index){
+	if (WAIT_STRATEGY == WAIT_SPIN && SPIN_CPU >= 0){
+		pinThread(SPIN_CPU + index); //This thread never sleeps, so it might as well have a core to itself
+	}
+	auto& shard = Read.get().shards[index];
+	auto ring = shard.ring;
+	auto ring_size = shard.size;
 	//By the time the server accepts, and the client connects, the pertinent memory has been set to 0
-	auto& segments = Read.get().segment_to_info;
 	std::array<uint8_t, 12> message_buf;
+	std::vector<uint8_t> local; //Where each record is copied to, if the ring is uncached
+	std::vector<ThreadInfo*> held; //Connections with data that hasn't been sent yet, so everything that's already in the ring for them goes out together
 
 	for(;;){
-		auto [head, tail, f ] = WaitForChange(Read, [](uint8_t a, uint8_t b){ return a!=b;}); //Wait until ring buffer is not empty (as denoted by a!=b)
+		auto [head, tail, f ] = WaitForChange(shard, [](uint64_t a, uint64_t b){ return a!=b;}); //Wait until ring buffer is not empty (as denoted by a!=b)
+		reader_epochs[index].store(epoch.load()); //From here to the end of the batch, connections that are removed stay around
 		
 		while(f(head, tail)){
 			
-			auto offset=segments[head].offset;
-			auto size = segments[head].size;
+			auto record = ring + head % ring_size;
+			if (uncached_ring){
+				local.resize(std::max<size_t>(local.size(), RECORD_ALIGN));
+				copyFromRing(local.data(), record, RECORD_ALIGN); //Just the header (and the start of the payload) for now...
+			}
 
-			auto [thread, msg_type, arg1] = unpackMessage(mem+offset);
+			auto [thread, msg_type, arg1] = unpackMessage(uncached_ring ? local.data() : record);
+			if (uncached_ring){
+				auto size = recordSize(msg_type == DATA ? arg1 : 0);
+				local.resize(std::max<size_t>(local.size(), size));
+				copyFromRing(local.data()+RECORD_ALIGN, record+RECORD_ALIGN, size-RECORD_ALIGN); //...then the rest of it
+				record = local.data();
+			}
 			//printf("Message type: %i\n", msg_type);
+			if(msg_type == PADDING){ //The next record is at the start of the ring, or right after this one if it stands in for a DATA record
+				head += (arg1 == 0) ? ring_size - head % ring_size : recordSize(arg1);
+				std::atomic_ref(*shard.head).store(head, std::memory_order_release);
+				flushDrive();
+				continue;
+			}
 			if(msg_type == CONNECT){ //Special case --- CONNECT on the host side means that you have to create the new thread ahead-of-time  
-				t2i_mutex.lock();
-				thread_to_info[thread]=	std::make_shared<ThreadInfo>();
-				t2i_mutex.unlock();
+				auto info = std::make_shared<ThreadInfo>();
+				info->thread = thread;
+				addConn(info);
 			}
 				
-			t2i_mutex.lock_shared(); //Makes sure that checking + retrieving object is one atomic operation
-
-			auto exists = thread_to_info.contains(thread);
-			std::shared_ptr<ThreadInfo> info = NULL;
-			if (exists){
-				info = thread_to_info[thread];
-			}
-			t2i_mutex.unlock_shared();
-			//printf("Exists: %i\n", exists);
+			auto info = findConn(thread);
 			//printf("Thread: %i\n", thread);
-			if (exists){
+			if (info != NULL){
 				switch(msg_type){
 					case(CONNECT): //Received request from client
 						{
 							auto id = arg1;
-							info->thread = thread;
-
-							connectToBackend(id, info->conn, context);
-
-							writeToRing(thread, CONFIRM, 0);
-
-							std::thread(HandleConn, thread, info).detach(); //TODO: Remove key argument from HandleConn function, since key is already available through info->thread
-
+							info->priority = getBackend(id)->priority;
 
+							connectBackend(info->shared_from_this(), getBackend(id), 0); //Everyone else's data keeps flowing in the meantime
 							break;
 						}
 
+					case(WRITE_HIGH):
+						{
+						info->write_high = arg1;
+						break;
+						}
 					case(WRITE):
 						{
-						writeToConn(*info->conn, message_buf, WRITE, arg1, 0);
+						packMessage(message_buf.data(), WRITE, arg1, std::exchange(info->write_high, 0));
+						enqueue(info, message_buf.data(), message_buf.size(), true);
+						if (held.empty() || held.back() != info){
+							held.push_back(info);
+						}
 						break;
 						}
 					case(DATA):
 						{
 						auto size = arg1;
-						asio::write(*info->conn, asio::buffer(mem+offset+12, size));
+						enqueue(info, record+12, size, true);
+						if (held.empty() || held.back() != info){
+							held.push_back(info);
+						}
 						break;
 						}
 					case(DISCONNECT):
 						{
-							SocketClose(info->conn); //Trigger the thread's shutdown sequence	
-							std::shared_lock lk(t2i_mutex);
-							t2i_delete_cv.wait(lk, [&]{return !thread_to_info.contains(info->thread);}); //Wait until map no longer has the thread (needed to preserve invariant).
+							enqueue(info, NULL, 0); //Once everything queued before it has been written, the socket is closed, which triggers the connection's shutdown sequence
+							unpause(info->shared_from_this());
+							if (info->confirming.exchange(false)){ //The host couldn't reach the backend, so the client just sees the socket close
+								closeConn(info->shared_from_this());
+							}
+							break;
 						}
 
 					case(CONFIRM): //Received confirmation of connection by server
 						{
-						info->connected = true;
-						info->connected.notify_all();
+						if (info->confirming.exchange(false)){
+							if (info->shm_size > 0){
+								{
+									std::scoped_lock lk(info->out_mu);
+									info->sending = true; //Holds on to anything for it until startShm has sent the CONFIRM
+								}
+								asio::post(context, [info = info->shared_from_this()](){ startShm(info); }); //Sending the fd and setting up the shared memory shouldn't hold up the rest of the ring
+								break;
+							}
+							packMessage(message_buf.data(), CONFIRM, 0, 0);
+							enqueue(info, message_buf.data(), message_buf.size()); //Tell UNIX socket that we've connected
+							readMessage(info->shared_from_this());
+						}
+						break;
+						}
+					case(PAUSE):
+						{
+						std::scoped_lock lk(info->pause_mu);
+						info->paused = true;
+						break;
+						}
+					case(RESUME):
+						{
+						unpause(info->shared_from_this());
+						break;
 						}
 				}
  
 			}
-			*(Read.get().head)=(++head);
+			head += recordSize(msg_type == DATA ? arg1 : 0);
+			std::atomic_ref(*shard.head).store(head, std::memory_order_release);
 			flushDrive();
 		}
+
+		for(auto& info: held){
+			flushConn(info);
+		}
+		held.clear();
+
+		reader_epochs[index].store(0);
+		if (retired_count > 0){
+			reclaim();
+		}
 	}
 }
 
 
 void HandleBackend(socket_ptr socket){
-	auto key = thread_counter++;
+	auto id = allocateId();
+	if (id == UINT32_MAX){ //Too many connections
+		return SocketClose(socket);
+	}
 
-	t2i_mutex.lock();
-	auto& info = thread_to_info[key];
-	info = std::make_shared<ThreadInfo>();
-	info->thread = key;
+	auto info = std::make_shared<ThreadInfo>();
+	info->thread = id;
 	info->conn = std::move(socket);
-	t2i_mutex.unlock();
+	addConn(info);
+
+	readMessage(info);
+}
 
-	std::thread(HandleConn, key, info).detach();
+void acceptNext(local::stream_protocol::acceptor& acceptor){
+	auto socket = new socket_type(context);
+	acceptor.async_accept(*socket, [&acceptor, socket](const asio::error_code& ec){
+		socket_ptr owned(socket);
+		if (!ec){
+			HandleBackend(std::move(owned));
+		}
+		acceptNext(acceptor);
+	});
 }
+
 void Server(){ //Only for client
 	local::stream_protocol::endpoint socket_endpoint(SERVER_SOCKET);
 	{
@@ -319,15 +1397,8 @@ void Server(){ //Only for client
 		unlink(SERVER_SOCKET.c_str());
 	}
 	}
-	local::stream_protocol::acceptor acceptor(context, socket_endpoint);
-	for (;;){
-		auto socket=std::make_unique<socket_type>(context, UNIX);
-	    	acceptor.accept(*socket);
-
-	
-	    	std::thread(HandleBackend, std::move(socket)).detach();
-	}
-
+	static local::stream_protocol::acceptor acceptor(context, socket_endpoint);
+	acceptNext(acceptor); //Runs on the workers from here on
 }
 
 int main(int argc, char** argv){	
@@ -346,6 +1417,7 @@ int main(int argc, char** argv){
 	#endif
 	
 	is_guest = getEnv("CONN_SERVER_IS_GUEST", IS_GUEST_DEFAULT);
+	uncached_ring = getEnv("CONN_SERVER_UNCACHED_RING", is_guest);
 	
 	if(is_guest){ //By default, we assumed we are on the host
 		std::swap(Read, Write);
@@ -376,30 +1448,38 @@ int main(int argc, char** argv){
 
 		info->mmap=static_cast<uint8_t*>(mmap(NULL, size, PROT_WRITE, MAP_SHARED, info->fd, 0));
 	
-		if(!is_guest){
-			memset(info->mmap,0, 2);
-			flushDrive(*info);
+		info->size = size;
+		info->shards = std::vector<ShardInfo>(NUM_SHARDS);
+
+		uint64_t shard_size = (size / NUM_SHARDS) & ~(uint64_t)(CACHE_LINE - 1);
+		for(int i = 0; i < NUM_SHARDS; i++){
+			auto& shard = info->shards[i];
+			shard.header = info->mmap + i*shard_size;
+			shard.ring = shard.header + RING_HEADER_SIZE;
+			shard.size = (shard_size - RING_HEADER_SIZE) & ~(uint64_t)(RECORD_ALIGN - 1);
+
+			if(!is_guest){
+				memset(shard.header, 0, RING_HEADER_SIZE);
+			}
 		}
+		flushDrive(*info);
+	}
 
-		size -= 2; //To account for <head> and <tail>
-		info->size = size; 
+	for(int i = 0; i < NUM_SHARDS; i++){
+		auto& read = Read.get().shards[i];
+		auto& write = Write.get().shards[i];
 
-		info->segment_to_info.reserve(NUM_SEGMENTS);
-		
-		uint32_t segment_size=size/NUM_SEGMENTS; //Later, we can use "fair allocation" to use all of the space available
-		
-		for(int i =0; i< NUM_SEGMENTS; i++){ //Has to start from 2 since the first two bytes are taken
-			info->segment_to_info.push_back({.offset=2+(i*segment_size),.size=segment_size });
-		}
+		read.head=reinterpret_cast<uint64_t*>(write.header); //Since reading only updates the head
+		read.tail=reinterpret_cast<uint64_t*>(read.header+CACHE_LINE);
 
-		
-	}
+		write.head=reinterpret_cast<uint64_t*>(read.header);
+		write.tail=reinterpret_cast<uint64_t*>(write.header+CACHE_LINE);
 
-	Read.get().head=Write.get().mmap+0; //Since reading only updates the head
-	Read.get().tail=Read.get().mmap+1;
+		write.reserved = *write.tail; //Pick up where the ring was left, in case we were restarted
+		write.published = *write.tail;
+	}
 
-	Write.get().head=Read.get().mmap+0;
-	Write.get().tail=Write.get().mmap+1;
+	MAX_RECORD_PAYLOAD = std::min<uint64_t>(getEnv("CONN_SERVER_MAX_RECORD", 64*1024), Write.get().shards[0].size/4); //Small enough that a few large messages can be in flight at once
 	
 	char buf[2] = "1";
 	ip::tcp::socket socket(context);
@@ -421,10 +1501,22 @@ int main(int argc, char** argv){
 	}
 
 	if (is_guest){
-		std::thread(Server).detach();
+		Server();
 	}
 		
-	std::thread(readFromRing).detach();
+	for(int i = 0; i < NUM_SHARDS; i++){
+		std::thread(readFromRing, i).detach();
+	}
+	std::thread(writeControl).detach();
+
+	auto guard = asio::make_work_guard(context);
+	for(int i = 0; i < WORKERS; i++){
+		std::thread([](){ context.run(); }).detach();
+	}
+
+	if (WAIT_STATS_INTERVAL > 0){
+		std::thread(reportWaits).detach();
+	}
 
 	asio::read(socket, asio::buffer(buf), ec); //As long as the client/server is alive, this should never return...
 	
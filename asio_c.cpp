@@ -9,25 +9,279 @@
 #include <mutex>
 #include <array>
 #include <tuple>
+#include <deque>
+#include <unordered_map>
+#include <cstring>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <condition_variable>
+#include <asio/thread_pool.hpp>
+
+enum FrameFormat : uint8_t { //First byte of every frame on the TCP path
+	FRAME_RAW = 0,
+	FRAME_LZ4, //Body is a single LZ4 block
+	FRAME_LZ4_BLOCKS, //Body is a sequence of <compressed size><uncompressed size><block>, one per piece of an asio_writev. Blocks where both sizes are equal are stored uncompressed.
+	FRAME_LZ4_STREAM, //Body is a single LZ4 block that may refer back to earlier FRAME_LZ4_STREAM messages on the connection (or the backend's dictionary)
+	FRAME_LZ4_PARALLEL, //Same body as FRAME_LZ4_BLOCKS, but the blocks are independent slices of one large message, and the compressed size in the header is replaced by the number of blocks, so they can be sent as soon as each one is compressed
+	FRAME_LARGE //Body is raw, and too big for an int, so the two sizes in the header are the low and high 32 bits of its size instead. Only sent by asio_write_begin, and only read by asio_read_begin.
+};
+
+typedef struct {
+	uint8_t format = FRAME_RAW;
+	uint32_t compressed_size = 0; //Size of the body on the wire
+	uint32_t uncompressed_size = 0;
+	bool pending = false; //The header has been read, but not the body
+} FrameHeader;
+
+typedef struct { //Used to decide, per message, whether compressing is worth it
+	double ratio = 0.5; //Running average of compressed size/uncompressed size
+	double compress_rate = 0; //Running average of how many bytes/second LZ4 gets through (0 if not measured yet)
+	double send_rate = 0; //Running average of how many bytes/second the socket takes
+	uint64_t window_bytes = 0; //What's been sent since send_rate was last updated...
+	double window_time = 0; //...and how long it took
+	int acceleration = 1; //Passed to LZ4_compress_fast --- higher is faster, but compresses less
+	int skipped = 0; //Messages sent uncompressed since compression was last tried
+} CompressionStats;
+
+#define STREAM_RING_SIZE (256*1024)
+#define STREAM_MAX_MESSAGE (64*1024) //Larger messages have enough redundancy of their own, so they are compressed independently
+
+typedef struct { //The history used by FRAME_LZ4_STREAM. Messages are copied into a ring so LZ4 can see them as one contiguous stream; both sides wrap at the same points, so they stay in sync.
+	std::unique_ptr<char[]> ring;
+	uint32_t offset = 0;
+	std::unique_ptr<LZ4_stream_t> encoder;
+	std::unique_ptr<LZ4_streamDecode_t> decoder;
+} StreamState;
+
+typedef struct { //Opt-in coalescing of small writes, see asio_set_batching
+	uint32_t max_bytes = 0; //0 means batching is off
+	std::chrono::microseconds max_delay{0};
+
+	buffer<uint8_t> buf; //Fully framed messages waiting to be sent
+	uint32_t size = 0;
+	std::chrono::steady_clock::time_point start; //When the oldest message in buf was added
+
+	bool failed = false; //A background flush failed, so the next write should report it
+	bool timing = false; //The delay timer is waiting, see batchTimeout
+	std::mutex mu; //Also held by anything writing to the socket directly while batching is on, so frames never interleave
+	std::condition_variable cv; //Signalled once the delay timer stops waiting
+	std::optional<asio::steady_timer> timer; //Only set up when max_delay is non-zero
+} BatchState;
+
+typedef struct { //Opt-in buffered receive, see asio_set_read_buffering
+	uint32_t size = 0; //0 means buffering is off
+	buffer<uint8_t> buf;
+	uint32_t start = 0, end = 0; //The unconsumed data is [start, end). Only compacted at the start of a read, so messages handed out from it stay valid until then.
+	std::vector<buffer<uint8_t>> decoded; //Where asio_read_many decompresses messages to, one per slot
+} RecvState;
+
+typedef struct { //A message the read-ahead thread has already read
+	buffer<uint8_t> data;
+	int len = 0;
+	bool err = false;
+} ReadAheadSlot;
+
+typedef struct { //Opt-in read-ahead, see asio_set_read_ahead
+	int depth = 0; //How many messages may be waiting to be handed out. 0 means read-ahead is off.
+	std::deque<ReadAheadSlot> ready;
+	std::vector<ReadAheadSlot> handed_out; //By the last read, so they stay valid until the next one
+	std::vector<buffer<uint8_t>> spare; //Left over from slots that have been handed back, for the reader to reuse
+	bool running = false; //The reader only stops on an error, or once it's turned off and has finished whatever read it was in the middle of
+	bool reading = false;
+	bool stop = false;
+	std::mutex mu;
+	std::condition_variable cv;
+	std::thread reader;
+} ReadAheadState;
+
+typedef struct { //See BackendInfo::shm_size
+	ShmRegion region; //Only mapped if the relay handed one over
+	std::mutex mu; //Only one thread at a time waits on the socket for a wakeup. The rest wait on cv, and check again whenever it gets one.
+	std::condition_variable cv;
+	bool listening = false;
+	bool closed = false;
+} ShmState;
+
+typedef struct { //Runs the async operations that have to block, one at a time (see runBlocking)
+	std::deque<std::function<void()>> ops;
+	bool busy = false; //In the middle of one of them
+	bool stop = false;
+	std::mutex mu;
+	std::condition_variable cv;
+	std::thread thread; //Only started by the first one
+} WaiterState;
+
+typedef struct { //A message being read or written a piece at a time, see asio_read_begin and asio_write_begin
+	uint64_t remaining = 0;
+	bool active = false;
+	char* buf = NULL; //When reading a message that had to be read in one go (since it's compressed), what's left of it
+} ChunkState;
 
 struct AsioConn {
 	std::optional<ip::tcp::acceptor> acceptor;
 	socket_ptr socket;
 	uint8_t size_buf[8];
 	std::array<uint8_t, 12> msg_buf;
+	uint8_t write_size_buf[8]; //Separate from the ones above, so one thread can read while another writes
+	std::array<uint8_t, 12> write_msg_buf;
 
 	BackendInfo* backend = NULL;
+	FrameHeader header; //Header of the frame currently being read
+	CompressionStats stats;
+	StreamState encode_stream;
+	StreamState decode_stream;
 	buffer<uint8_t> compressed_buf;
+	buffer<uint8_t> write_buf; //Holds compressed output on the write side, so a buffer returned by asio_read can be passed straight back to asio_write
 	buffer<uint8_t> uncompressed_buf;
 	buffer<char> output_buf; //For applications that need to write the result of an operation to a buffer, then pass it to asio_write
+
+	BatchState batch;
+	RecvState recv;
+	ReadAheadState ahead;
+	ShmState shm;
+	ChunkState read_chunks;
+	ChunkState write_chunks;
+	WaiterState read_waiter; //Separate, since a read and a write can be in flight at once
+	WaiterState write_waiter;
+	bool client = false; //Made by asio_connect, so it can go back to the pool once it's closed
+
+	std::optional<asio::strand<asio::io_context::executor_type>> strand; //Serializes the completion handlers of the async operations on this connection
+	std::deque<std::function<void()>> read_queue; //Async operations waiting for the previous one to finish, since asio does not allow overlapping reads (or writes) on the same socket
+	std::deque<std::function<void()>> write_queue;
 };
 
-static int COMPRESSION_CUTOFF= 1000000/4;
-//static int COMPRESSION_CUTOFF= std::numeric_limits<int>::max(); //Effectively disable compression
+static int COMPRESSION_MIN = 1024; //Smaller messages are never compressed, since the savings can't make up for the extra work
+static int STREAM_COMPRESSION_MIN = 32; //Much lower, since even small messages can refer back to earlier ones
+static int COMPRESSION_SAMPLE = 4096; //How much of a large message is test-compressed before committing to the whole thing
+static int COMPRESSION_PROBE = 16; //How often compression is retried on a connection where it stopped paying off
+static int MAX_ACCELERATION = 64;
+static double INCOMPRESSIBLE_RATIO = 0.9;
+static uint32_t PARALLEL_BLOCK_SIZE = 1024*1024;
+static uint32_t PARALLEL_MIN = 4*PARALLEL_BLOCK_SIZE; //Smaller messages aren't worth splitting up
+static uint64_t SEND_WINDOW = 4*1024*1024; //How much has to have gone over the link before send_rate is updated
 
 asio::io_context context;
 ip::tcp::resolver resolver(context);
 
+static asio::thread_pool& timerPool(){ //Runs the batching delay timers of every connection. Not context, since that only runs inside asio_run
+	static asio::thread_pool pool(1);
+	return pool;
+}
+
+static asio::thread_pool& compressionPool(){ //Only started once a message is big enough to need it
+	static asio::thread_pool pool(getEnv("CONN_COMPRESSION_THREADS", 4));
+	return pool;
+}
+
+template<typename F> static auto runOnPool(F f){
+	auto task=std::make_shared<std::packaged_task<decltype(f())()>>(std::move(f));
+	auto result=task->get_future();
+	asio::post(compressionPool(), [task](){ (*task)(); });
+	return result;
+}
+
+static void wakeRelay(AsioConn* conn){ //It's blocked on one of the shared rings
+	uint8_t byte=0;
+	asio::error_code ec;
+	conn->socket->send(asio::buffer(&byte, 1), 0, ec);
+}
+
+static void waitShm(AsioConn* conn, ShmRing& ring, bool for_space){ //Blocks until the relay changes ring, or the connection is closed
+	auto& shm=conn->shm;
+	std::unique_lock lk(shm.mu);
+	if (!shmWait(ring, for_space)){
+		return;
+	}
+	if (shm.closed){
+		throw asio::system_error(asio::error::eof);
+	}
+	if (shm.listening){
+		shm.cv.wait(lk);
+		return;
+	}
+
+	shm.listening=true;
+	lk.unlock();
+	uint8_t bytes[64];
+	asio::error_code ec;
+	conn->socket->read_some(asio::buffer(bytes), ec);
+	lk.lock();
+	shm.listening=false;
+	shm.closed=bool(ec);
+	shm.cv.notify_all();
+	if (ec){
+		throw asio::system_error(ec);
+	}
+}
+
+template<typename Buffers> static size_t shmSend(AsioConn* conn, const Buffers& buffers){
+	auto& ring=conn->shm.region.to_server;
+	for(auto it=asio::buffer_sequence_begin(buffers); it!=asio::buffer_sequence_end(buffers); ++it){
+		auto data=static_cast<const uint8_t*>(it->data());
+		size_t size=it->size();
+		while(size > 0){
+			auto written=shmWrite(ring, data, size);
+			if (written==0){
+				waitShm(conn, ring, true);
+				continue;
+			}
+			data+=written;
+			size-=written;
+			if (shmShouldWake(ring)){
+				wakeRelay(conn);
+			}
+		}
+	}
+	return asio::buffer_size(buffers);
+}
+
+template<typename Buffers, typename Done> static size_t shmReceive(AsioConn* conn, const Buffers& buffers, Done done){ //Reads until buffers are full, or done says that what has been read is enough
+	auto& ring=conn->shm.region.to_client;
+	size_t transferred=0;
+	for(auto it=asio::buffer_sequence_begin(buffers); it!=asio::buffer_sequence_end(buffers); ++it){
+		auto data=static_cast<uint8_t*>(it->data());
+		size_t size=it->size();
+		while(size > 0){
+			auto read=shmRead(ring, data, size);
+			if (read==0){
+				if (done(transferred)){
+					return transferred;
+				}
+				waitShm(conn, ring, false);
+				continue;
+			}
+			data+=read;
+			size-=read;
+			transferred+=read;
+			if (shmShouldWake(ring)){
+				wakeRelay(conn);
+			}
+		}
+	}
+	return transferred;
+}
+
+template<typename Buffers, typename... Condition> static size_t socketRead(AsioConn* conn, const Buffers& buffers, Condition... condition){
+	if (conn->shm.region.map!=NULL){
+		return shmReceive(conn, buffers, [&]([[maybe_unused]] size_t transferred){ return ((condition(asio::error_code(), transferred)==0) || ...); });
+	}
+	return asio::read(*conn->socket, buffers, condition...);
+}
+
+template<typename Buffers> static size_t socketWrite(AsioConn* conn, const Buffers& buffers){
+	if (conn->shm.region.map!=NULL){
+		return shmSend(conn, buffers);
+	}
+	return asio::write(*conn->socket, buffers);
+}
+
+static AsioConn* newConn(){
+	auto conn=new AsioConn();
+	conn->strand.emplace(asio::make_strand(context));
+	return conn;
+}
+
 void connect_to_server(socket_type& socket){
 	asio::error_code ec;
 	while(true){
@@ -38,19 +292,37 @@ void connect_to_server(socket_type& socket){
 	}
 }
 
-AsioConn* asio_connect(int id){ //For clients
-	auto conn=new AsioConn();
+static void destroyConn(AsioConn* conn);
+
+static AsioConn* openConn(int id){ //Returns NULL if the backend can't be reached
+	auto conn=newConn();
+	conn->client=true;
 	
 	auto backend = getBackend(id, &(conn->backend));
 
-	if (backend->use_tcp){
-		connectToBackend(backend, conn->socket, context);
-	}else{
-conn->socket=std::make_unique<socket_type>(context, UNIX);
-		connect_to_server(*conn->socket);
-		writeToConn(*conn->socket, conn->msg_buf, CONNECT, id, 0);
-		readFromConn(*conn->socket, conn->msg_buf);
+	try{
+		if (backend->use_tcp){
+			connectToBackend(backend, conn->socket, context);
+		}else{
+			conn->socket=std::make_unique<socket_type>(context, UNIX);
+			connect_to_server(*conn->socket);
+			writeToConn(*conn->socket, conn->msg_buf, CONNECT, id, backend->shm_size);
 
+			int fd;
+			auto [msg_type, shm_size, arg2] = readWithFd(*conn->socket, conn->msg_buf, &fd); //The relay may not have been able to make it, so it says what it actually did. If it couldn't reach the backend, it closes the socket instead.
+			if (fd >= 0){
+				bool mapped=shmMap(fd, shm_size, conn->shm.region);
+				close(fd);
+				if (!mapped){ //The relay only talks through the shared memory from now on
+					destroyConn(conn);
+					return NULL;
+				}
+			}
+		}
+	}
+	catch(asio::system_error& e){
+		destroyConn(conn);
+		return NULL;
 	}
 	
 
@@ -58,8 +330,81 @@ conn->socket=std::make_unique<socket_type>(context, UNIX);
 
 }
 
+static std::mutex pools_mutex;
+static std::unordered_map<BackendInfo*, std::deque<AsioConn*>> pools; //Idle client connections, per backend
+
+static bool isIdle(AsioConn* conn){ //Whether the connection is still open, with nothing waiting to be read
+	asio::error_code ec, ignored;
+	uint8_t bytes[64];
+
+	conn->socket->non_blocking(true, ec);
+	if (ec){
+		return false;
+	}
+	bool idle;
+	if (conn->shm.region.map!=NULL){ //Leftover wakeups don't count
+		while(!ec){
+			conn->socket->receive(asio::buffer(bytes), 0, ec);
+		}
+		idle=ec==asio::error::would_block && std::get<1>(shmPeek(conn->shm.region.to_client))==0;
+	}else{
+		conn->socket->receive(asio::buffer(bytes, 1), socket_type::message_peek, ec);
+		idle=ec==asio::error::would_block;
+	}
+	conn->socket->non_blocking(false, ignored);
+
+	return idle;
+}
+
+static AsioConn* takeFromPool(BackendInfo* backend){
+	std::scoped_lock lk(pools_mutex);
+	auto& pool=pools[backend];
+	while(!pool.empty()){
+		auto conn=pool.front();
+		pool.pop_front();
+		if (isIdle(conn)){
+			return conn;
+		}
+		destroyConn(conn); //The other side went away while it was in the pool
+	}
+	return NULL;
+}
+
+AsioConn* asio_connect(int id){ //For clients
+	auto conn=takeFromPool(getBackend(id));
+	if (conn!=NULL){
+		return conn;
+	}
+	return openConn(id);
+}
+
+void asio_prewarm(int id, int count){
+	auto backend=getBackend(id);
+	{
+	std::scoped_lock lk(pools_mutex);
+	backend->pool_size=std::max(backend->pool_size, count); //Otherwise, they would be closed instead of going back to the pool
+	}
+
+	while(true){
+		{
+		std::scoped_lock lk(pools_mutex);
+		if (pools[backend].size() >= (size_t)count){
+			return;
+		}
+		}
+
+		auto conn=openConn(id);
+		if (conn==NULL){
+			return;
+		}
+
+		std::scoped_lock lk(pools_mutex);
+		pools[backend].push_back(conn);
+	}
+}
+
 AsioConn* asio_server_init(int id){ //For backends
-	auto server=new AsioConn();
+	auto server=newConn();
 	
 	auto backend = getBackend(id, &(server->backend));
 	
@@ -69,7 +414,7 @@ AsioConn* asio_server_init(int id){ //For backends
 }
 
 AsioConn* asio_server_accept(AsioConn* server){ //For backends
-	auto conn=new AsioConn();
+	auto conn=newConn();
 	
 	conn->socket=std::make_unique<socket_type>(context, TCP);
 	server->acceptor->accept(*conn->socket);
@@ -82,10 +427,174 @@ AsioConn* asio_server_accept(AsioConn* server){ //For backends
 
 }
 
-void asio_close(AsioConn* conn){
-	if (conn==NULL){
+static void recordSend(AsioConn* conn, uint64_t size, std::chrono::duration<double> elapsed);
+
+template<typename Buffers> static size_t timedWrite(AsioConn* conn, const Buffers& buffers){ //Only the time spent sending counts towards the send rate, not the time spent waiting for batch.mu
+	auto start=std::chrono::steady_clock::now();
+	auto sent=socketWrite(conn, buffers);
+	recordSend(conn, sent, std::chrono::steady_clock::now()-start);
+	return sent;
+}
+
+static void flushBatch(AsioConn* conn, bool timed = true){ //batch.mu must be held. The delay timer doesn't time its flushes, since the stats belong to the writing thread
+	auto& batch=conn->batch;
+	if (batch.size==0){
+		return;
+	}
+	auto size=batch.size;
+	batch.size=0; //Even if the write fails, so a broken batch isn't sent again
+	if (timed){
+		timedWrite(conn, asio::buffer(batch.buf.data(), size));
+	}else{
+		socketWrite(conn, asio::buffer(batch.buf.data(), size));
+	}
+}
+
+static void batchTimeout(AsioConn* conn, const asio::error_code& ec);
+
+static void startTimer(AsioConn* conn){ //batch.mu must be held
+	auto& batch=conn->batch;
+	batch.timing=true;
+	batch.timer->expires_at(batch.start + batch.max_delay);
+	batch.timer->async_wait([conn](const asio::error_code& ec){ batchTimeout(conn, ec); });
+}
+
+static void batchTimeout(AsioConn* conn, const asio::error_code& ec){ //Makes sure nothing waits in the batch for longer than max_delay
+	auto& batch=conn->batch;
+	std::unique_lock lk(batch.mu);
+
+	if (!ec && batch.max_bytes!=0 && batch.size!=0){
+		if (std::chrono::steady_clock::now() < batch.start + batch.max_delay){ //The batch it was started for was already sent, and this one is newer
+			return startTimer(conn);
+		}
+		try{
+			flushBatch(conn, false);
+		}
+		catch(asio::system_error& e){
+			batch.failed=true;
+		}
+	}
+	batch.timing=false;
+	batch.cv.notify_all();
+}
+
+static std::unique_lock<std::mutex> claimSocket(AsioConn* conn){ //For writes that go straight to the socket: sends whatever is batched, and keeps the delay timer out until the lock is released
+	auto& batch=conn->batch;
+	if (batch.max_bytes==0){
+		return {};
+	}
+	std::unique_lock lk(batch.mu);
+	if (batch.failed){
+		batch.failed=false;
+		throw asio::system_error(asio::error::broken_pipe);
+	}
+	flushBatch(conn);
+	return lk;
+}
+
+static size_t sendFrame(AsioConn* conn, const std::vector<asio::const_buffer>& buffers){
+	auto& batch=conn->batch;
+	if (batch.max_bytes==0){
+		return timedWrite(conn, buffers);
+	}
+
+	auto len=asio::buffer_size(buffers);
+	std::unique_lock lk(batch.mu);
+	if (batch.failed){
+		batch.failed=false;
+		throw asio::system_error(asio::error::broken_pipe);
+	}
+
+	if (batch.size + len > batch.max_bytes){
+		flushBatch(conn);
+	}
+	if (len >= batch.max_bytes){ //Too big to gain anything from being copied
+		return timedWrite(conn, buffers);
+	}
+
+	batch.buf.reserve(batch.size + len);
+	asio::buffer_copy(asio::buffer(batch.buf.data() + batch.size, len), buffers);
+	if (batch.size==0){
+		batch.start=std::chrono::steady_clock::now();
+		if (batch.timer && !batch.timing){ //Otherwise, it's still waiting for an earlier batch, and moves on to this one once it's done
+			startTimer(conn);
+		}
+	}
+	batch.size+=len;
+
+	if (batch.size >= batch.max_bytes){
+		flushBatch(conn);
+	}
+	return len;
+}
+
+static void stopBatching(AsioConn* conn){
+	auto& batch=conn->batch;
+	std::unique_lock lk(batch.mu);
+	batch.max_bytes=0;
+	if (batch.timer){
+		batch.timer->cancel();
+		batch.cv.wait(lk, [&](){ return !batch.timing; }); //The timer uses conn
+		batch.timer.reset();
+	}
+	try{
+		flushBatch(conn);
+	}
+	catch(asio::system_error& e){
+		batch.failed=true;
+	}
+}
+
+static void fillRecv(AsioConn* conn, size_t n){ //Makes sure at least n (which has to fit in the buffer) bytes are buffered, reading as much more as fits
+	auto& recv=conn->recv;
+	size_t available=recv.end-recv.start;
+	if (available >= n){
+		return;
+	}
+
+	recv.buf.reserve(recv.size);
+	auto data=recv.buf.data();
+	if (recv.start + n > recv.buf.capacity()){
+		memmove(data, data+recv.start, available);
+		recv.start=0;
+		recv.end=available;
+	}
+	recv.end+=socketRead(conn, asio::buffer(data+recv.end, recv.buf.capacity()-recv.end), asio::transfer_at_least(n-available));
+}
+
+static void readBuffered(AsioConn* conn, uint8_t* dst, size_t n){
+	auto& recv=conn->recv;
+	size_t buffered=std::min<size_t>(n, recv.end-recv.start);
+	memcpy(dst, recv.buf.data()+recv.start, buffered);
+	recv.start+=buffered;
+	dst+=buffered;
+	n-=buffered;
+
+	if (n==0){
+		return;
+	}
+	if (recv.size==0 || n >= recv.size/2){ //Large reads skip the extra copy
+		socketRead(conn, asio::buffer(dst, n));
+		return;
+	}
+
+	fillRecv(conn, n);
+	memcpy(dst, recv.buf.data()+recv.start, n);
+	recv.start+=n;
+}
+
+template<typename Buffers> static void readExact(AsioConn* conn, const Buffers& buffers){ //All blocking reads go through here, so they see what is already in the receive buffer first
+	auto& recv=conn->recv;
+	if (recv.size==0 && recv.start==recv.end){
+		socketRead(conn, buffers);
 		return;
 	}
+	for(auto it=asio::buffer_sequence_begin(buffers); it!=asio::buffer_sequence_end(buffers); ++it){
+		readBuffered(conn, static_cast<uint8_t*>(it->data()), it->size());
+	}
+}
+
+static void destroyConn(AsioConn* conn){
 	if(conn->acceptor){
 		conn->acceptor->close();
 	}
@@ -93,104 +602,1368 @@ void asio_close(AsioConn* conn){
 	if (conn->socket){
 		conn->socket->close();
 	}
+	shmUnmap(conn->shm.region);
 
 	delete conn;
 }
 
-void asio_read(AsioConn* conn, char** buf, int* len, bool* err){
-	*err=false;
-	 
-	 if (conn==NULL){
-	 	*err=true;
+static bool stopReadAhead(AsioConn* conn);
+static bool stopWaiters(AsioConn* conn);
+
+static bool returnToPool(AsioConn* conn){ //Only connections that are in a clean state are kept, since the next user expects a fresh one
+	if (!conn->client || conn->header.pending || conn->recv.start!=conn->recv.end || !conn->read_queue.empty() || !conn->write_queue.empty() || conn->batch.failed || conn->read_chunks.active || conn->write_chunks.active){ //A message left half-read or half-written would be picked up by the next user
+		return false;
+	}
+	if (!isIdle(conn)){
+		return false;
+	}
+
+	conn->recv.size=0;
+	for(auto buf: {&conn->compressed_buf, &conn->write_buf, &conn->uncompressed_buf, &conn->recv.buf}){ //Whatever the last user needed goes back to the pool, instead of sitting on an idle connection
+		buf->release();
+	}
+	conn->output_buf.release();
+	conn->recv.decoded.clear();
+	conn->recv.start=conn->recv.end=0;
+	conn->read_chunks=ChunkState();
+	conn->write_chunks=ChunkState();
+
+	std::scoped_lock lk(pools_mutex);
+	auto& pool=pools[conn->backend];
+	if (pool.size() >= (size_t)conn->backend->pool_size){
+		return false;
+	}
+	pool.push_back(conn);
+	return true;
+}
+
+void asio_close(AsioConn* conn){
+	if (conn==NULL){
+		return;
+	}
+	if (conn->socket){
+		stopBatching(conn);
+	}
+	auto clean=stopReadAhead(conn);
+	clean=stopWaiters(conn) && clean; //Both have to be stopped either way, since they use conn
+	if (clean && returnToPool(conn)){
 		return;
 	}
-	try{
-		if (conn->backend->use_tcp){
-			uint8_t is_compressed=0;
-			asio::read(*conn->socket, std::vector<asio::mutable_buffer>{asio::buffer(&is_compressed,1),asio::buffer(conn->size_buf)});
-			auto compressed_size=deserializeInt(conn->size_buf, 0);
-			auto uncompressed_size=deserializeInt(conn->size_buf, 4);
-		
-			conn->compressed_buf.reserve(compressed_size);
-			conn->uncompressed_buf.reserve(uncompressed_size);
 
-			asio::read(*(conn->socket), asio::buffer(conn->compressed_buf.data(), compressed_size));
-			
-			char* compressed_buf=reinterpret_cast<char*>(conn->compressed_buf.data());
-			char* uncompressed_buf=reinterpret_cast<char*>(conn->uncompressed_buf.data());
+	destroyConn(conn);
+}
 
-			if (is_compressed){
-				*buf=uncompressed_buf;
-				*len=uncompressed_size;
-				LZ4_decompress_safe(compressed_buf, uncompressed_buf, compressed_size, uncompressed_size);
-				
-			}else{
-				*buf=compressed_buf;
-				*len=compressed_size;
-			}
-		}else{
-			uint32_t size;
-			std::tie(std::ignore, size, std::ignore) = readFromConn(*conn->socket, conn->msg_buf); //Recieve WRITE response from server
-			conn->uncompressed_buf.reserve(size);
-			asio::read(*conn->socket, asio::buffer(conn->uncompressed_buf.data(), size));
+static char* nextStreamSlot(StreamState& state, BackendInfo* backend, uint32_t len){ //Returns where the next message of the stream goes in the ring
+	bool reset=false;
+	if (!state.ring){
+		state.ring.reset(new char[STREAM_RING_SIZE]);
+		reset=true;
+	}
+	if (state.offset + len > STREAM_RING_SIZE){
+		state.offset=0;
+		reset=!backend->dictionary.empty(); //Otherwise, LZ4 keeps referring to the previous message at the end of the ring
+	}
 
-			*buf=reinterpret_cast<char*>(conn->uncompressed_buf.data());
-			*len=size;	
+	if (reset){
+		if (state.encoder){
+			LZ4_loadDict(state.encoder.get(), backend->dictionary.data(), backend->dictionary.size());
+		}
+		if (state.decoder){
+			LZ4_setStreamDecode(state.decoder.get(), backend->dictionary.data(), backend->dictionary.size());
 		}
+	}
+
+	auto slot=state.ring.get()+state.offset;
+	state.offset+=len;
+	return slot;
+}
 
+static char* decompressStream(AsioConn* conn, const char* src, uint32_t src_size, uint32_t size){ //Returns where the message was decoded to, which stays valid until the next read
+	auto& state=conn->decode_stream;
+	if (size > STREAM_MAX_MESSAGE){
+		return NULL;
 	}
-	catch(asio::system_error& e){
-		*err=true;
+	if (!state.decoder){
+		state.decoder.reset(new LZ4_streamDecode_t());
+		state.ring.reset();
 	}
 
+	auto dst=nextStreamSlot(state, conn->backend, size);
+	if (LZ4_decompress_safe_continue(state.decoder.get(), src, dst, src_size, size) != (int)size){
+		return NULL;
+	}
+	return dst;
 }
 
-void asio_write(AsioConn* conn, char* buf, int len, bool* err){
-	*err=false;
-	if (conn==NULL){
-		*err=true;
-		return;
+static bool decompressBlock(const char* src, uint32_t src_size, char* dst, uint32_t dst_size){ //For FRAME_LZ4_BLOCKS and FRAME_LZ4_PARALLEL
+	if (src_size==dst_size){
+		memcpy(dst, src, dst_size);
+		return true;
 	}
-	try{
-		if(conn->backend->use_tcp){
-			uint8_t is_compressed;
-			
-			auto max_compressed_size=LZ4_compressBound(len);
-			conn->compressed_buf.reserve(max_compressed_size);
-			char* compressed_buf=reinterpret_cast<char*>(conn->compressed_buf.data());
+	return LZ4_decompress_safe(src, dst, src_size, dst_size) == (int)dst_size;
+}
 
-			const char* input;
-			uint32_t size;
+static uint32_t parallelBound(FrameHeader& header){ //Upper bound on the body of a FRAME_LZ4_PARALLEL frame
+	auto bound=(uint64_t)header.uncompressed_size + header.uncompressed_size/255 + 16 + 16*(uint64_t)header.compressed_size; //Same as LZ4_compressBound, which gives up on sizes past LZ4_MAX_INPUT_SIZE
+	return std::min<uint64_t>(bound, UINT32_MAX);
+}
 
-			if ((conn->backend->compression) && (len>=COMPRESSION_CUTOFF)){
-				is_compressed=1;
-				size=LZ4_compress_default(buf, compressed_buf, len, max_compressed_size);
-				input=compressed_buf;
-			}else{
-				is_compressed=0;
-				input=buf;
-				size=len;
-			}
-			
-			serializeInt(conn->size_buf, 0, size);
-			serializeInt(conn->size_buf, 4, len);
+static bool readParallel(AsioConn* conn, FrameHeader& header, char* dst){ //Each block is decompressed on the pool while the next one is still arriving
+	auto count=header.compressed_size;
+	auto bound=parallelBound(header);
+	conn->compressed_buf.prepare(bound);
+	auto src=conn->compressed_buf.data();
 
+	std::vector<std::future<bool>> results;
+	bool ok=true;
+	uint32_t in=0, out=0;
 
-			asio::write(*(conn->socket), std::vector<asio::const_buffer>{asio::buffer(&is_compressed, 1), asio::buffer(conn->size_buf), asio::buffer(input, size)});
-		}else{
-			writeToConn(*conn->socket, conn->msg_buf, WRITE, len, 0);
-			asio::write(*conn->socket, asio::buffer(buf, len));
+	try{
+		for(uint32_t i=0; i<count; i++){
+			if (bound - in < 8){
+				throw asio::system_error(asio::error::message_size);
+			}
+			readExact(conn, asio::buffer(src+in, 8));
+			auto block_compressed=deserializeInt(src, in);
+			auto block_uncompressed=deserializeInt(src, in+4);
+			in+=8;
 
-			//readFromConn(*conn->socket, conn->msg_buf);
+			if (block_compressed > bound - in || block_uncompressed > header.uncompressed_size - out){ //Written so neither can wrap around
+				throw asio::system_error(asio::error::message_size);
+			}
+			readExact(conn, asio::buffer(src+in, block_compressed));
+
+			results.push_back(runOnPool([block=(char*)src+in, block_compressed, block_dst=dst+out, block_uncompressed](){
+				return decompressBlock(block, block_compressed, block_dst, block_uncompressed);
+			}));
+			in+=block_compressed;
+			out+=block_uncompressed;
 		}
 	}
 	catch(asio::system_error& e){
-		*err=1;
+		for(auto& result: results){ //The blocks still refer to compressed_buf and dst
+			result.wait();
+		}
+		throw;
+	}
+	header.pending=false;
+
+	for(auto& result: results){
+		ok&=result.get();
 	}
+	conn->compressed_buf.trim();
+	return ok && out==header.uncompressed_size;
 }
 
-char* asio_get_buf(AsioConn* conn, uint32_t* cap){
-	conn->output_buf.reserve(*cap);
+static bool decompressFrame(AsioConn* conn, uint8_t format, const char* src, uint32_t src_size, char* dst, uint32_t dst_size){
+	switch(format){
+		case FRAME_LZ4:
+			return LZ4_decompress_safe(src, dst, src_size, dst_size) == (int)dst_size;
+		case FRAME_LZ4_BLOCKS:
+		{
+			uint32_t in=0, out=0;
+			while(src_size - in >= 8){ //Written so none of the checks can wrap around
+				auto block_compressed=deserializeInt((uint8_t*)src, in);
+				auto block_uncompressed=deserializeInt((uint8_t*)src, in+4);
+				in+=8;
+
+				if (block_compressed > src_size - in || block_uncompressed > dst_size - out){
+					return false;
+				}
+
+				if (!decompressBlock(src+in, block_compressed, dst+out, block_uncompressed)){
+					return false;
+				}
+				in+=block_compressed;
+				out+=block_uncompressed;
+			}
+			return out==dst_size;
+		}
+		case FRAME_LZ4_STREAM:
+		{
+			auto decoded=decompressStream(conn, src, src_size, dst_size);
+			if (decoded!=NULL){
+				memcpy(dst, decoded, dst_size);
+			}
+			return decoded!=NULL;
+		}
+		default:
+			return false;
+	}
+}
+
+static void trimCompressed(AsioConn* conn, const char* buf){ //compressed_buf is only scratch space, unless the message was handed out from it
+	if (buf!=reinterpret_cast<char*>(conn->compressed_buf.data())){
+		conn->compressed_buf.trim();
+	}
+}
+
+static bool decodeFrame(AsioConn* conn, uint8_t format, uint32_t compressed_size, uint32_t uncompressed_size, char** buf, int* len){ //Expects the body of the frame to already be in compressed_buf
+	char* compressed_buf=reinterpret_cast<char*>(conn->compressed_buf.data());
+	char* uncompressed_buf=reinterpret_cast<char*>(conn->uncompressed_buf.data());
+
+	if (format==FRAME_LZ4_STREAM){ //Already has a home in the ring, so skip the copy
+		*buf=decompressStream(conn, compressed_buf, compressed_size, uncompressed_size);
+		*len=uncompressed_size;
+		return *buf!=NULL;
+
+	}else if (format!=FRAME_RAW){
+		*buf=uncompressed_buf;
+		*len=uncompressed_size;
+		return decompressFrame(conn, format, compressed_buf, compressed_size, uncompressed_buf, uncompressed_size);
+		
+	}else{
+		*buf=compressed_buf;
+		*len=compressed_size;
+		return true;
+	}
+}
+
+static FrameHeader& readHeader(AsioConn* conn){ //Only reads from the socket if the previous header has already been consumed
+	auto& header=conn->header;
+	if (header.pending){
+		return header;
+	}
+
+	if (conn->backend->use_tcp){
+		readExact(conn, std::vector<asio::mutable_buffer>{asio::buffer(&header.format,1),asio::buffer(conn->size_buf)});
+		header.compressed_size=deserializeInt(conn->size_buf, 0);
+		header.uncompressed_size=deserializeInt(conn->size_buf, 4);
+	}else{
+		uint32_t size, high;
+		readExact(conn, asio::buffer(conn->msg_buf));
+		std::tie(std::ignore, size, high) = unpackMessage(conn->msg_buf.data()); //Recieve WRITE response from server
+		auto large=(high!=0 || size > INT32_MAX); //Same as FRAME_LARGE on TCP
+		header.format=large ? FRAME_LARGE : FRAME_RAW;
+		header.compressed_size=size;
+		header.uncompressed_size=large ? high : size;
+	}
+	header.pending=true;
+
+	return header;
+}
+
+static void readMessage(AsioConn* conn, char** buf, int* len, bool* err){
+	auto& header=readHeader(conn);
+
+	if (header.format==FRAME_LARGE){ //Too big to hand out in one piece, so it's left for asio_read_begin
+		*err=true;
+		return;
+	}
+
+	if (header.format==FRAME_LZ4_PARALLEL){
+		conn->uncompressed_buf.prepare(header.uncompressed_size);
+		*buf=reinterpret_cast<char*>(conn->uncompressed_buf.data());
+		*len=header.uncompressed_size;
+		*err=!readParallel(conn, header, *buf);
+		return;
+	}
+
+	conn->compressed_buf.prepare(header.compressed_size);
+	if (header.format!=FRAME_RAW && header.format!=FRAME_LZ4_STREAM){
+		conn->uncompressed_buf.prepare(header.uncompressed_size);
+	}
+
+	readExact(conn, asio::buffer(conn->compressed_buf.data(), header.compressed_size));
+	header.pending=false;
+	
+	*err=!decodeFrame(conn, header.format, header.compressed_size, header.uncompressed_size, buf, len);
+	trimCompressed(conn, *buf);
+}
+
+static void keepMessage(AsioConn* conn, ReadAheadSlot& slot, char* buf){ //Moves a message that was just read somewhere the next read won't overwrite it. Unless it was decoded into the stream ring, that's just a matter of swapping buffers.
+	for(auto src: {&conn->uncompressed_buf, &conn->compressed_buf}){
+		if (buf==reinterpret_cast<char*>(src->data())){
+			std::swap(slot.data, *src);
+			return;
+		}
+	}
+	slot.data.prepare(slot.len);
+	memcpy(slot.data.data(), buf, slot.len);
+}
+
+static void readAhead(AsioConn* conn){ //Keeps up to depth messages read (and decompressed) ahead of the application
+	auto& ahead=conn->ahead;
+	std::unique_lock lk(ahead.mu);
+
+	while(!ahead.stop){
+		if (ahead.ready.size() >= (size_t)ahead.depth){
+			ahead.cv.wait(lk);
+			continue;
+		}
+
+		ReadAheadSlot slot;
+		if (!ahead.spare.empty()){
+			slot.data=std::move(ahead.spare.back());
+			ahead.spare.pop_back();
+		}
+		ahead.reading=true;
+		lk.unlock();
+
+		char* buf;
+		try{
+			readMessage(conn, &buf, &slot.len, &slot.err);
+			if (!slot.err){
+				keepMessage(conn, slot, buf);
+			}
+		}
+		catch(asio::system_error& e){
+			slot.err=true;
+		}
+
+		lk.lock();
+		ahead.reading=false;
+		auto err=slot.err;
+		ahead.ready.push_back(std::move(slot));
+		ahead.cv.notify_all();
+		if (err){ //Everything after it would fail too
+			break;
+		}
+	}
+	ahead.running=false;
+	ahead.cv.notify_all();
+}
+
+static int takeReadAhead(AsioConn* conn, AsioBuffer* msgs, int max, bool* err){ //Hands out up to max messages that have been read ahead, waiting for one if there aren't any yet. Returns 0 if read-ahead is off, and everything it read has been handed out.
+	auto& ahead=conn->ahead;
+	if (!ahead.reader.joinable()){
+		return 0;
+	}
+
+	std::unique_lock lk(ahead.mu);
+	for(auto& slot: ahead.handed_out){ //The application is done with them once it reads again
+		ahead.spare.push_back(std::move(slot.data));
+	}
+	ahead.handed_out.clear();
+
+	ahead.cv.wait(lk, [&](){ return !ahead.ready.empty() || !ahead.running; });
+	if (ahead.ready.empty()){
+		lk.unlock();
+		ahead.reader.join();
+		return 0;
+	}
+
+	int count=0;
+	while(count < max && !ahead.ready.empty()){
+		auto& slot=ahead.handed_out.emplace_back(std::move(ahead.ready.front()));
+		ahead.ready.pop_front();
+		if (slot.err){
+			*err=true;
+			break;
+		}
+		msgs[count].buf=reinterpret_cast<char*>(slot.data.data());
+		msgs[count].len=slot.len;
+		count++;
+	}
+	ahead.cv.notify_all();
+	return count;
+}
+
+static void putBackReadAhead(AsioConn* conn){ //Undoes handing out the last message, so the next read gets it again
+	auto& ahead=conn->ahead;
+	std::scoped_lock lk(ahead.mu);
+	ahead.ready.push_front(std::move(ahead.handed_out.back()));
+	ahead.handed_out.pop_back();
+}
+
+static bool stopReadAhead(AsioConn* conn){ //Returns whether nothing was lost, so the connection can be reused
+	auto& ahead=conn->ahead;
+	if (!ahead.reader.joinable()){
+		return true;
+	}
+
+	bool clean;
+	{
+	std::scoped_lock lk(ahead.mu);
+	ahead.stop=true;
+	ahead.depth=0;
+	ahead.cv.notify_all();
+	clean=!ahead.reading && ahead.ready.empty();
+	}
+	if (!clean){ //The reader may be blocked on a message that will never come, and the ones it already read would be lost anyway
+		asio::error_code ec;
+		conn->socket->shutdown(socket_type::shutdown_receive, ec);
+	}
+	ahead.reader.join();
+
+	ahead.ready.clear();
+	ahead.handed_out.clear();
+	ahead.spare.clear();
+	ahead.running=false;
+	ahead.stop=false;
+	return clean;
+}
+
+static bool peekHeader(AsioConn* conn, FrameHeader& header, uint32_t& header_size){ //Parses the header at the front of the receive buffer without consuming it
+	auto& recv=conn->recv;
+	auto available=recv.end-recv.start;
+	auto data=recv.buf.data()+recv.start;
+
+	if (conn->backend->use_tcp){
+		header_size=9;
+		if (available < header_size){
+			return false;
+		}
+		header.format=data[0];
+		header.compressed_size=deserializeInt(data, 1);
+		header.uncompressed_size=deserializeInt(data, 5);
+	}else{
+		header_size=12;
+		if (available < header_size){
+			return false;
+		}
+		uint32_t size, high;
+		std::tie(std::ignore, size, high) = unpackMessage(data);
+		auto large=(high!=0 || size > INT32_MAX); //Same as FRAME_LARGE on TCP
+		header.format=large ? FRAME_LARGE : FRAME_RAW;
+		header.compressed_size=size;
+		header.uncompressed_size=large ? high : size;
+	}
+	return true;
+}
+
+void asio_read_many(AsioConn* conn, AsioBuffer* msgs, int max, int* count, bool* err){
+	*err=false;
+	*count=0;
+
+	if (conn==NULL || max <= 0){
+		*err=true;
+		return;
+	}
+	*count=takeReadAhead(conn, msgs, max, err);
+	if (*count > 0 || *err){
+		return;
+	}
+	try{
+		auto& recv=conn->recv;
+		if (recv.size==0 || conn->header.pending){ //Nothing to batch up, so it's just a normal read
+			readMessage(conn, &msgs[0].buf, &msgs[0].len, err);
+			*count=1;
+			return;
+		}
+		if (recv.decoded.size() < (size_t)max){
+			recv.decoded.resize(max);
+		}
+
+		for(;;){
+			FrameHeader header;
+			uint32_t header_size;
+
+			while(*count < max && peekHeader(conn, header, header_size) && header.format!=FRAME_LZ4_PARALLEL && header.format!=FRAME_LARGE){ //Hand out every frame that has fully arrived
+				auto frame_size=header_size+header.compressed_size;
+				if (frame_size > recv.end-recv.start){
+					break;
+				}
+
+				auto& msg=msgs[*count];
+				auto src=reinterpret_cast<char*>(recv.buf.data()+recv.start+header_size);
+				if (header.format==FRAME_RAW){
+					msg.buf=src;
+				}else{
+					auto& decoded=recv.decoded[*count];
+					decoded.prepare(header.uncompressed_size);
+					msg.buf=reinterpret_cast<char*>(decoded.data());
+					*err|=!decompressFrame(conn, header.format, src, header.compressed_size, msg.buf, header.uncompressed_size);
+				}
+				msg.len=header.uncompressed_size;
+
+				recv.start+=frame_size;
+				(*count)++;
+			}
+
+			if (*count > 0){
+				return;
+			}
+
+			if (!peekHeader(conn, header, header_size)){
+				fillRecv(conn, conn->backend->use_tcp ? 9 : 12);
+				continue;
+			}
+
+			auto frame_size=header_size+header.compressed_size;
+			if (header.format==FRAME_LZ4_PARALLEL || header.format==FRAME_LARGE || frame_size > recv.size){ //Doesn't fit, so read it the normal way
+				readMessage(conn, &msgs[0].buf, &msgs[0].len, err);
+				*count=1;
+				return;
+			}
+			fillRecv(conn, frame_size);
+		}
+	}
+	catch(asio::system_error& e){
+		*err=true;
+	}
+}
+
+void asio_read(AsioConn* conn, char** buf, int* len, bool* err){
+	*err=false;
+	 
+	 if (conn==NULL){
+	 	*err=true;
+		return;
+	}
+	if (conn->recv.size > 0 || conn->ahead.reader.joinable()){ //Fully buffered frames (or ones that have been read ahead) can be handed out without a copy
+		AsioBuffer msg;
+		int count;
+		asio_read_many(conn, &msg, 1, &count, err);
+		*buf=msg.buf;
+		*len=msg.len;
+		return;
+	}
+	try{
+		readMessage(conn, buf, len, err);
+	}
+	catch(asio::system_error& e){
+		*err=true;
+	}
+
+}
+
+void asio_set_read_buffering(AsioConn* conn, int size){
+	if (conn==NULL){
+		return;
+	}
+	conn->recv.size=std::max(size, 0); //Anything already buffered is still handed out first
+}
+
+void asio_set_read_ahead(AsioConn* conn, int depth){
+	if (conn==NULL){
+		return;
+	}
+	auto& ahead=conn->ahead;
+	{
+	std::scoped_lock lk(ahead.mu);
+	ahead.depth=std::max(depth, 0);
+	ahead.stop=(ahead.depth==0); //A read the reader is in the middle of still finishes, and is handed out first
+	ahead.cv.notify_all();
+	if (ahead.running || ahead.depth==0){
+		return;
+	}
+	}
+
+	if (ahead.reader.joinable()){ //Left over from an earlier run that has already stopped
+		ahead.reader.join();
+	}
+	ahead.running=true;
+	ahead.reader=std::thread(readAhead, conn);
+}
+
+void asio_read_into(AsioConn* conn, char* buf, int cap, int* len, bool* err){
+	*err=false;
+
+	if (conn==NULL || cap < 0){
+		*err=true;
+		return;
+	}
+	AsioBuffer msg;
+	if (takeReadAhead(conn, &msg, 1, err) > 0){
+		*len=msg.len;
+		if (msg.len > cap){
+			putBackReadAhead(conn);
+		}else{
+			memcpy(buf, msg.buf, msg.len);
+		}
+		return;
+	}else if (*err){
+		return;
+	}
+	try{
+		auto& header=readHeader(conn);
+		*len=header.uncompressed_size;
+
+		if (header.format==FRAME_LARGE){ //Left for asio_read_begin
+			*err=true;
+			return;
+		}
+		if (header.uncompressed_size > (uint32_t)cap){ //Leave the frame in the socket so the caller can retry with a bigger buffer
+			return;
+		}
+
+		if (header.format==FRAME_LZ4_PARALLEL){
+			*err=!readParallel(conn, header, buf);
+		}else if (header.format!=FRAME_RAW){
+			conn->compressed_buf.prepare(header.compressed_size);
+			readExact(conn, asio::buffer(conn->compressed_buf.data(), header.compressed_size));
+			header.pending=false;
+
+			*err=!decompressFrame(conn, header.format, reinterpret_cast<char*>(conn->compressed_buf.data()), header.compressed_size, buf, header.uncompressed_size);
+			conn->compressed_buf.trim();
+		}else{
+			readExact(conn, asio::buffer(buf, header.compressed_size));
+			header.pending=false;
+		}
+	}
+	catch(asio::system_error& e){
+		*err=true;
+	}
+}
+
+void asio_read_begin(AsioConn* conn, uint64_t* len, bool* err){
+	*err=false;
+	*len=0;
+
+	if (conn==NULL || conn->read_chunks.active){
+		*err=true;
+		return;
+	}
+	auto& chunks=conn->read_chunks;
+	chunks.buf=NULL;
+
+	AsioBuffer msg;
+	if (takeReadAhead(conn, &msg, 1, err) > 0){
+		chunks.buf=msg.buf;
+		chunks.remaining=msg.len;
+	}else if (*err){
+		return;
+	}else{
+		try{
+			auto& header=readHeader(conn);
+			if (header.format==FRAME_LARGE){
+				chunks.remaining=header.compressed_size | (uint64_t(header.uncompressed_size) << 32);
+			}else if (header.format==FRAME_RAW){
+				chunks.remaining=header.compressed_size;
+			}else{ //Compressed, so it can't be decoded a piece at a time
+				int size;
+				readMessage(conn, &chunks.buf, &size, err);
+				if (*err){
+					return;
+				}
+				chunks.remaining=size;
+			}
+		}
+		catch(asio::system_error& e){
+			*err=true;
+			return;
+		}
+	}
+
+	if (chunks.buf==NULL && chunks.remaining==0){
+		conn->header.pending=false;
+	}
+	chunks.active=(chunks.remaining > 0);
+	*len=chunks.remaining;
+}
+
+void asio_read_chunk(AsioConn* conn, char* buf, int cap, int* len, bool* err){
+	*err=false;
+	*len=0;
+
+	if (conn==NULL || cap < 0){
+		*err=true;
+		return;
+	}
+	auto& chunks=conn->read_chunks;
+	if (!chunks.active){ //Everything has already been read
+		return;
+	}
+
+	auto size=(int)std::min<uint64_t>(chunks.remaining, cap);
+	try{
+		if (chunks.buf!=NULL){
+			memcpy(buf, chunks.buf, size);
+			chunks.buf+=size;
+		}else{
+			readExact(conn, asio::buffer(buf, size));
+		}
+	}
+	catch(asio::system_error& e){
+		*err=true;
+		chunks.active=false;
+		return;
+	}
+
+	chunks.remaining-=size;
+	*len=size;
+	if (chunks.remaining==0){
+		if (chunks.buf==NULL){ //It was read straight from the socket, so the frame is only done now
+			conn->header.pending=false;
+		}
+		chunks.active=false;
+	}
+}
+
+static double average(double old_value, double new_value){
+	return (old_value==0) ? new_value : (0.75*old_value + 0.25*new_value);
+}
+
+static bool useStream(AsioConn* conn, uint32_t len){
+	return conn->backend->stream_compression && len <= STREAM_MAX_MESSAGE;
+}
+
+static bool shouldCompress(AsioConn* conn, const char* sample, uint32_t sample_len, uint32_t len){ //sample is the start of the message
+	auto& stats=conn->stats;
+	auto min_size=useStream(conn, len) ? STREAM_COMPRESSION_MIN : COMPRESSION_MIN;
+	if (!conn->backend->compression || len < (uint32_t)min_size){
+		return false;
+	}
+
+	if (stats.ratio > INCOMPRESSIBLE_RATIO){ //Recent messages didn't compress, so only try every once in a while in case the data changed
+		if (++stats.skipped < COMPRESSION_PROBE){
+			return false;
+		}
+		stats.skipped=0;
+	}
+
+	if (!useStream(conn, len) && len > (uint32_t)(4*COMPRESSION_SAMPLE) && sample_len >= (uint32_t)COMPRESSION_SAMPLE){ //Cheap check before spending time on the whole message
+		char sample_buf[LZ4_COMPRESSBOUND(COMPRESSION_SAMPLE)];
+		auto sample_size=LZ4_compress_fast(sample, sample_buf, COMPRESSION_SAMPLE, sizeof(sample_buf), stats.acceleration);
+		if (sample_size <= 0 || sample_size > INCOMPRESSIBLE_RATIO*COMPRESSION_SAMPLE){
+			stats.ratio=average(stats.ratio, 1);
+			return false;
+		}
+	}
+
+	if (stats.compress_rate > 0 && stats.send_rate > 0){ //Compressing only pays off if the time spent compressing is less than the time saved sending
+		auto saved=(1-stats.ratio)/stats.send_rate;
+		auto spent=1/stats.compress_rate;
+
+		if (spent > saved){
+			if (stats.acceleration < MAX_ACCELERATION){
+				stats.acceleration*=2;
+			}else{
+				return false;
+			}
+		}else if (spent < saved/2 && stats.acceleration > 1){ //Plenty of headroom, so trade some speed for ratio
+			stats.acceleration/=2;
+		}
+	}
+
+	return true;
+}
+
+static int compressBlock(AsioConn* conn, const char* src, char* dst, int len, int cap, bool stream = false){ //Returns the compressed size, and records how well it went
+	auto& stats=conn->stats;
+	
+	auto start=std::chrono::steady_clock::now();
+	int size;
+	if (stream){
+		auto& state=conn->encode_stream;
+		if (!state.encoder){
+			state.encoder.reset(new LZ4_stream_t());
+			LZ4_initStream(state.encoder.get(), sizeof(LZ4_stream_t));
+			state.ring.reset();
+		}
+		auto slot=nextStreamSlot(state, conn->backend, len);
+		memcpy(slot, src, len);
+		size=LZ4_compress_fast_continue(state.encoder.get(), slot, dst, len, cap, stats.acceleration);
+	}else{
+		size=LZ4_compress_fast(src, dst, len, cap, stats.acceleration);
+	}
+	std::chrono::duration<double> elapsed=std::chrono::steady_clock::now()-start;
+
+	if (size > 0){
+		stats.ratio=average(stats.ratio, (double)size/len);
+		if (elapsed.count() > 0){
+			stats.compress_rate=average(stats.compress_rate, len/elapsed.count());
+		}
+	}
+	return size;
+}
+
+static void recordSend(AsioConn* conn, uint64_t size, std::chrono::duration<double> elapsed){ //A write only has to wait for the link once the socket buffer is full, so only what didn't fit in it counts
+	if (size < (uint64_t)(16*COMPRESSION_SAMPLE)){ //Small writes just land in the socket buffer, so they say nothing about the link
+		return;
+	}
+	asio::socket_base::send_buffer_size send_buffer; //Read every time, since the kernel grows it as it goes
+	asio::error_code ec;
+	conn->socket->get_option(send_buffer, ec);
+	if (ec || size <= (uint64_t)send_buffer.value()){
+		return;
+	}
+
+	auto& stats=conn->stats;
+	stats.window_bytes+=size-send_buffer.value();
+	stats.window_time+=elapsed.count();
+	if (stats.window_bytes >= SEND_WINDOW && stats.window_time > 0){ //One write on its own is too noisy
+		stats.send_rate=average(stats.send_rate, stats.window_bytes/stats.window_time);
+		stats.window_bytes=0;
+		stats.window_time=0;
+	}
+}
+
+static std::tuple<uint8_t, const char*, uint32_t> encodeFrame(AsioConn* conn, buffer<uint8_t>& compressed, char* buf, int len, bool compress){ //Returns the format of the frame, and the payload that should be sent
+	if (compress){
+		auto max_compressed_size=LZ4_compressBound(len);
+		compressed.prepare(max_compressed_size);
+		char* compressed_buf=reinterpret_cast<char*>(compressed.data());
+
+		if (useStream(conn, len)){ //Has to be sent compressed regardless of how it went, since it is now part of the history on this side
+			auto size=compressBlock(conn, buf, compressed_buf, len, max_compressed_size, true);
+			return {FRAME_LZ4_STREAM, compressed_buf, size};
+		}
+
+		auto size=compressBlock(conn, buf, compressed_buf, len, max_compressed_size);
+		if (size > 0 && size < len){
+			return {FRAME_LZ4, compressed_buf, size};
+		}
+	}
+	return {FRAME_RAW, buf, len};
+}
+
+static void writeParallel(AsioConn* conn, char* buf, uint32_t len){ //Blocks are compressed on the pool, and each one is sent as soon as it (and the ones before it) are done
+	auto& stats=conn->stats;
+	uint32_t count=(len + PARALLEL_BLOCK_SIZE - 1)/PARALLEL_BLOCK_SIZE;
+	uint32_t stride=8 + LZ4_compressBound(PARALLEL_BLOCK_SIZE);
+	
+	conn->write_buf.prepare(count*stride);
+	auto out=conn->write_buf.data();
+
+	std::vector<std::future<std::tuple<int, double>>> results;
+	for(uint32_t i=0; i<count; i++){
+		results.push_back(runOnPool([src=buf+i*PARALLEL_BLOCK_SIZE, block_len=(int)std::min(PARALLEL_BLOCK_SIZE, len-i*PARALLEL_BLOCK_SIZE), dst=out+i*stride, stride, acceleration=stats.acceleration](){
+			auto start=std::chrono::steady_clock::now();
+			auto size=LZ4_compress_fast(src, reinterpret_cast<char*>(dst+8), block_len, stride-8, acceleration);
+			std::chrono::duration<double> elapsed=std::chrono::steady_clock::now()-start;
+
+			if (size <= 0 || size >= block_len){ //Incompressible, so store it as-is
+				size=block_len;
+				memcpy(dst+8, src, block_len);
+			}
+			serializeInt(dst, 0, size);
+			serializeInt(dst, 4, block_len);
+			return std::make_tuple(size, elapsed.count());
+		}));
+	}
+
+	try{
+		auto lk=claimSocket(conn); //The blocks go out one by one, so nothing else can be sent in between
+
+		uint8_t format=FRAME_LZ4_PARALLEL;
+		serializeInt(conn->write_size_buf, 0, count);
+		serializeInt(conn->write_size_buf, 4, len);
+		socketWrite(conn, std::vector<asio::const_buffer>{asio::buffer(&format, 1), asio::buffer(conn->write_size_buf)});
+
+		std::chrono::duration<double> sending(0);
+		uint64_t sent=0;
+		for(uint32_t i=0; i<count; i++){
+			auto [size, elapsed] = results[i].get();
+			auto block_len=std::min(PARALLEL_BLOCK_SIZE, len-i*PARALLEL_BLOCK_SIZE);
+			stats.ratio=average(stats.ratio, (double)size/block_len);
+			if (elapsed > 0){
+				stats.compress_rate=average(stats.compress_rate, block_len/elapsed);
+			}
+
+			auto start=std::chrono::steady_clock::now();
+			sent+=socketWrite(conn, asio::buffer(out+i*stride, 8+size));
+			sending+=std::chrono::steady_clock::now()-start;
+		}
+		recordSend(conn, sent, sending);
+	}
+	catch(asio::system_error& e){
+		for(auto& result: results){ //Don't return while the pool is still using buf
+			if (result.valid()){
+				result.wait();
+			}
+		}
+		throw;
+	}
+	conn->write_buf.trim();
+}
+
+void asio_write(AsioConn* conn, char* buf, int len, bool* err){
+	*err=false;
+	if (conn==NULL || len < 0){
+		*err=true;
+		return;
+	}
+	try{
+		if(conn->backend->use_tcp){
+			auto compress=shouldCompress(conn, buf, len, len);
+			if (compress && (uint32_t)len >= PARALLEL_MIN){
+				return writeParallel(conn, buf, len);
+			}
+
+			auto [format, input, size] = encodeFrame(conn, conn->write_buf, buf, len, compress);
+			
+			serializeInt(conn->write_size_buf, 0, size);
+			serializeInt(conn->write_size_buf, 4, len);
+
+			sendFrame(conn, {asio::buffer(&format, 1), asio::buffer(conn->write_size_buf), asio::buffer(input, size)});
+			conn->write_buf.trim();
+		}else{
+			packMessage(conn->write_msg_buf.data(), WRITE, len, 0);
+			sendFrame(conn, {asio::buffer(conn->write_msg_buf), asio::buffer(buf, len)});
+
+			//readFromConn(*conn->socket, conn->msg_buf);
+		}
+	}
+	catch(asio::system_error& e){
+		*err=1;
+	}
+}
+
+void asio_writev(AsioConn* conn, AsioBuffer* bufs, int count, bool* err){
+	*err=false;
+	if (conn==NULL){
+		*err=true;
+		return;
+	}
+	if (bufs==NULL || count <= 0){
+		*err=true;
+		return;
+	}
+	if (count==1){
+		return asio_write(conn, bufs[0].buf, bufs[0].len, err);
+	}
+
+	uint64_t total=0;
+	for(int i=0; i<count; i++){
+		if (bufs[i].len < 0){
+			*err=true;
+			return;
+		}
+		total+=bufs[i].len;
+	}
+	if (total > INT32_MAX){ //Same limit as asio_write
+		*err=true;
+		return;
+	}
+	uint32_t len=total;
+
+	try{
+		std::vector<asio::const_buffer> buffers;
+		uint8_t format; //Has to outlive buffers
+
+		if(conn->backend->use_tcp){
+			uint32_t size;
+
+			uint64_t max_compressed_size=0;
+			bool compressible=true; //LZ4_compressBound gives 0 for pieces past LZ4_MAX_INPUT_SIZE, so those have to be sent raw
+			for(int i=0; i<count; i++){
+				compressible=compressible && bufs[i].len <= LZ4_MAX_INPUT_SIZE;
+				max_compressed_size+=8+(uint64_t)LZ4_compressBound(bufs[i].len);
+			}
+			compressible=compressible && max_compressed_size <= UINT32_MAX; //The sizes in the frame are 32-bit
+
+			if (compressible && shouldCompress(conn, bufs[0].buf, bufs[0].len, len)){ //Each piece is compressed into its own block, so nothing has to be concatenated
+				format=FRAME_LZ4_BLOCKS;
+				
+				conn->write_buf.prepare(max_compressed_size);
+				auto compressed_buf=conn->write_buf.data();
+
+				size=0;
+				for(int i=0; i<count; i++){
+					auto block_size=compressBlock(conn, bufs[i].buf, reinterpret_cast<char*>(compressed_buf+size+8), bufs[i].len, LZ4_compressBound(bufs[i].len));
+					if (block_size<=0 || block_size>=bufs[i].len){ //Incompressible, so store it as-is
+						block_size=bufs[i].len;
+						memcpy(compressed_buf+size+8, bufs[i].buf, block_size);
+					}
+					serializeInt(compressed_buf, size, block_size);
+					serializeInt(compressed_buf, size+4, bufs[i].len);
+					size+=8+block_size;
+				}
+
+				buffers.push_back(asio::buffer(&format, 1));
+				buffers.push_back(asio::buffer(conn->write_size_buf));
+				buffers.push_back(asio::buffer(compressed_buf, size));
+			}else{
+				format=FRAME_RAW;
+				size=len;
+
+				buffers.push_back(asio::buffer(&format, 1));
+				buffers.push_back(asio::buffer(conn->write_size_buf));
+				for(int i=0; i<count; i++){
+					buffers.push_back(asio::buffer(bufs[i].buf, bufs[i].len));
+				}
+			}
+
+			serializeInt(conn->write_size_buf, 0, size);
+			serializeInt(conn->write_size_buf, 4, len);
+		}else{
+			packMessage(conn->write_msg_buf.data(), WRITE, len, 0);
+
+			buffers.push_back(asio::buffer(conn->write_msg_buf));
+			for(int i=0; i<count; i++){
+				buffers.push_back(asio::buffer(bufs[i].buf, bufs[i].len));
+			}
+		}
+		
+		sendFrame(conn, buffers);
+		conn->write_buf.trim();
+	}
+	catch(asio::system_error& e){
+		*err=true;
+	}
+}
+
+void asio_write_begin(AsioConn* conn, uint64_t len, bool* err){
+	*err=false;
+	if (conn==NULL || conn->write_chunks.active){
+		*err=true;
+		return;
+	}
+	try{
+		auto lk=claimSocket(conn); //Whatever was batched has to go out before it
+		uint32_t low=len, high=len >> 32;
+		if(conn->backend->use_tcp){
+			auto large=(len > INT32_MAX);
+			uint8_t format=large ? FRAME_LARGE : FRAME_RAW; //Streamed messages are never compressed, and ones that fit in a normal frame can still be read with asio_read
+			serializeInt(conn->write_size_buf, 0, low);
+			serializeInt(conn->write_size_buf, 4, large ? high : low);
+			socketWrite(conn, std::vector<asio::const_buffer>{asio::buffer(&format, 1), asio::buffer(conn->write_size_buf)});
+		}else{
+			packMessage(conn->write_msg_buf.data(), WRITE, low, high); //The relay passes the high bits along
+			socketWrite(conn, asio::buffer(conn->write_msg_buf));
+		}
+	}
+	catch(asio::system_error& e){
+		*err=true;
+		return;
+	}
+	conn->write_chunks.remaining=len;
+	conn->write_chunks.active=true;
+}
+
+void asio_write_chunk(AsioConn* conn, char* buf, int len, bool* err){
+	*err=false;
+	if (conn==NULL || !conn->write_chunks.active || len < 0 || (uint64_t)len > conn->write_chunks.remaining){
+		*err=true;
+		return;
+	}
+	try{
+		auto lk=claimSocket(conn);
+		socketWrite(conn, asio::buffer(buf, len));
+	}
+	catch(asio::system_error& e){
+		*err=true;
+		return;
+	}
+	conn->write_chunks.remaining-=len;
+}
+
+void asio_write_end(AsioConn* conn, bool* err){
+	*err=(conn==NULL || !conn->write_chunks.active || conn->write_chunks.remaining!=0);
+	if (conn!=NULL){
+		conn->write_chunks.active=false;
+		conn->write_chunks.remaining=0;
+	}
+}
+
+void asio_set_batching(AsioConn* conn, int max_bytes, int max_delay_us){
+	if (conn==NULL){
+		return;
+	}
+	stopBatching(conn);
+	if (max_bytes <= 0){
+		return;
+	}
+
+	auto& batch=conn->batch;
+	std::unique_lock lk(batch.mu);
+	batch.max_bytes=max_bytes;
+	batch.max_delay=std::chrono::microseconds(max_delay_us);
+	if (max_delay_us > 0){
+		batch.timer.emplace(timerPool().get_executor());
+	}
+}
+
+void asio_flush(AsioConn* conn, bool* err){
+	*err=false;
+	if (conn==NULL){
+		*err=true;
+		return;
+	}
+	try{
+		claimSocket(conn);
+	}
+	catch(asio::system_error& e){
+		*err=true;
+	}
+}
+
+static void enqueueOp(AsioConn* conn, std::deque<std::function<void()>>& queue, std::function<void()> op){ //Runs op once every operation queued before it has finished
+	asio::post(*conn->strand, [conn, &queue, op=std::move(op)](){
+		queue.push_back(std::move(op));
+		if (queue.size()==1){
+			queue.front()();
+		}
+	});
+}
+
+static void finishOp(std::deque<std::function<void()>>& queue){ //Must be called on the strand
+	queue.pop_front();
+	if (!queue.empty()){
+		queue.front()();
+	}
+}
+
+typedef struct {
+	uint8_t format=FRAME_RAW;
+	uint8_t size_buf[8];
+	std::array<uint8_t, 12> msg_buf;
+
+	FrameHeader header; //Only used by FRAME_LZ4_PARALLEL
+	uint32_t block=0, in=0, out=0;
+	std::vector<std::future<bool>> results;
+} AsyncReadState;
+
+typedef std::function<void(char*, int, bool)> AsyncReadFinish;
+
+static void asyncReadParallel(AsioConn* conn, std::shared_ptr<AsyncReadState> state, AsyncReadFinish finish){ //Reads one block at a time, handing each one to the pool
+	auto src=conn->compressed_buf.data();
+	auto dst=reinterpret_cast<char*>(conn->uncompressed_buf.data());
+
+	auto done=[conn, state, finish, dst](bool err){
+		bool ok=!err;
+		for(auto& result: state->results){
+			ok&=result.get();
+		}
+		conn->compressed_buf.trim();
+		finish(dst, state->header.uncompressed_size, !ok || state->out!=state->header.uncompressed_size);
+	};
+
+	if (state->block==state->header.compressed_size){
+		return done(false);
+	}
+	if (parallelBound(state->header) - state->in < 8){
+		return done(true);
+	}
+
+	asio::async_read(*conn->socket, asio::buffer(src+state->in, 8), asio::bind_executor(*conn->strand, [conn, state, finish, src, dst, done](const asio::error_code& ec, size_t){
+		if (ec){
+			return done(true);
+		}
+		auto block_compressed=deserializeInt(src, state->in);
+		auto block_uncompressed=deserializeInt(src, state->in+4);
+		state->in+=8;
+
+		if (block_compressed > parallelBound(state->header) - state->in || block_uncompressed > state->header.uncompressed_size - state->out){ //Written so neither can wrap around
+			return done(true);
+		}
+
+		asio::async_read(*conn->socket, asio::buffer(src+state->in, block_compressed), asio::bind_executor(*conn->strand, [conn, state, finish, src, dst, done, block_compressed, block_uncompressed](const asio::error_code& ec, size_t){
+			if (ec){
+				return done(true);
+			}
+			state->results.push_back(runOnPool([block=(char*)src+state->in, block_compressed, block_dst=dst+state->out, block_uncompressed](){
+				return decompressBlock(block, block_compressed, block_dst, block_uncompressed);
+			}));
+			state->in+=block_compressed;
+			state->out+=block_uncompressed;
+			state->block++;
+
+			asyncReadParallel(conn, state, finish);
+		}));
+	}));
+}
+
+static void runWaiter(WaiterState* waiter){ //Until it's stopped, and everything queued before that has been run
+	std::unique_lock lk(waiter->mu);
+	for(;;){
+		waiter->cv.wait(lk, [waiter](){ return waiter->stop || !waiter->ops.empty(); });
+		if (waiter->ops.empty()){
+			return;
+		}
+		auto op=std::move(waiter->ops.front());
+		waiter->ops.pop_front();
+		waiter->busy=true;
+		lk.unlock();
+		op();
+		lk.lock();
+		waiter->busy=false;
+	}
+}
+
+static bool stopWaiters(AsioConn* conn){ //Returns whether neither was in the middle of an operation, so the connection can be reused
+	bool clean=true;
+	for(auto waiter: {&conn->read_waiter, &conn->write_waiter}){
+		std::scoped_lock lk(waiter->mu);
+		waiter->stop=true;
+		waiter->cv.notify_all();
+		clean&=!waiter->busy && waiter->ops.empty();
+	}
+	if (!clean && conn->socket){ //They may be blocked on something that will never come
+		asio::error_code ec;
+		conn->socket->shutdown(socket_type::shutdown_both, ec);
+	}
+
+	for(auto waiter: {&conn->read_waiter, &conn->write_waiter}){
+		if (waiter->thread.joinable()){
+			waiter->thread.join();
+		}
+		waiter->stop=false;
+	}
+	return clean;
+}
+
+template<typename Op> static void runBlocking(AsioConn* conn, WaiterState& waiter, Op op){ //Shared memory has nothing for asio to wait on, so the operation is run on one of the connection's waiter threads, and its completion is run on the strand like any other
+	auto work=std::make_shared<asio::executor_work_guard<asio::io_context::executor_type>>(context.get_executor()); //Keeps asio_run from returning in the meantime
+	std::scoped_lock lk(waiter.mu);
+	if (!waiter.thread.joinable()){
+		waiter.thread=std::thread(runWaiter, &waiter);
+	}
+	waiter.ops.push_back([conn, op, work](){
+		asio::post(*conn->strand, [completion=op(), work](){ completion(); });
+	});
+	waiter.cv.notify_one();
+}
+
+void asio_async_read(AsioConn* conn, asio_read_cb cb, void* user_data){
+	if (conn==NULL){
+		cb(conn, NULL, 0, true, user_data);
+		return;
+	}
+
+	enqueueOp(conn, conn->read_queue, [conn, cb, user_data](){
+		auto state=std::make_shared<AsyncReadState>();
+
+		AsyncReadFinish finish=[conn, cb, user_data](char* buf, int len, bool err){
+			cb(conn, buf, len, err, user_data); //buf is only overwritten by the next queued read, so it stays valid for the duration of the callback
+			finishOp(conn->read_queue);
+		};
+
+		if (conn->shm.region.map!=NULL || conn->ahead.reader.joinable()){ //Nothing for asio to wait on (or the read-ahead thread already is), so this just waits for asio_read
+			runBlocking(conn, conn->read_waiter, [conn, finish](){
+				char* buf;
+				int len;
+				bool err;
+				asio_read(conn, &buf, &len, &err);
+				return [finish, buf, len, err](){ finish(buf, len, err); };
+			});
+		}else if (conn->backend->use_tcp){
+			asio::async_read(*conn->socket, std::vector<asio::mutable_buffer>{asio::buffer(&state->format,1),asio::buffer(state->size_buf)}, asio::bind_executor(*conn->strand, [conn, state, finish](const asio::error_code& ec, size_t){
+				if (ec){
+					return finish(NULL, 0, true);
+				}
+				auto compressed_size=deserializeInt(state->size_buf, 0);
+				auto uncompressed_size=deserializeInt(state->size_buf, 4);
+
+				if (state->format==FRAME_LARGE){ //Can only be streamed
+					return finish(NULL, 0, true);
+				}
+				if (state->format==FRAME_LZ4_PARALLEL){
+					state->header={.format=state->format, .compressed_size=compressed_size, .uncompressed_size=uncompressed_size};
+					try{
+						conn->compressed_buf.prepare(parallelBound(state->header));
+						conn->uncompressed_buf.prepare(uncompressed_size);
+					}
+					catch(asio::system_error& e){
+						return finish(NULL, 0, true);
+					}
+					return asyncReadParallel(conn, state, finish);
+				}
+
+				try{
+					conn->compressed_buf.prepare(compressed_size);
+					conn->uncompressed_buf.prepare(uncompressed_size);
+				}
+				catch(asio::system_error& e){
+					return finish(NULL, 0, true);
+				}
+
+				asio::async_read(*conn->socket, asio::buffer(conn->compressed_buf.data(), compressed_size), asio::bind_executor(*conn->strand, [conn, state, finish, compressed_size, uncompressed_size](const asio::error_code& ec, size_t){
+					if (ec){
+						return finish(NULL, 0, true);
+					}
+					char* buf;
+					int len;
+					auto ok=decodeFrame(conn, state->format, compressed_size, uncompressed_size, &buf, &len);
+					trimCompressed(conn, buf);
+					finish(buf, len, !ok);
+				}));
+			}));
+		}else{
+			asio::async_read(*conn->socket, asio::buffer(state->msg_buf), asio::bind_executor(*conn->strand, [conn, state, finish](const asio::error_code& ec, size_t){
+				if (ec){
+					return finish(NULL, 0, true);
+				}
+				auto [msg_type, size, high] = unpackMessage(state->msg_buf.data()); //WRITE response from server
+				if (high!=0 || size > INT32_MAX){ //Can only be streamed
+					return finish(NULL, 0, true);
+				}
+				try{
+					conn->uncompressed_buf.prepare(size);
+				}
+				catch(asio::system_error& e){
+					return finish(NULL, 0, true);
+				}
+
+				asio::async_read(*conn->socket, asio::buffer(conn->uncompressed_buf.data(), size), asio::bind_executor(*conn->strand, [conn, finish, size](const asio::error_code& ec, size_t){
+					finish(reinterpret_cast<char*>(conn->uncompressed_buf.data()), size, bool(ec));
+				}));
+			}));
+		}
+	});
+}
+
+typedef struct {
+	uint8_t format;
+	uint8_t size_buf[8];
+	std::array<uint8_t, 12> msg_buf;
+	buffer<uint8_t> compressed_buf; //Each write has its own, since several can be queued at once
+} AsyncWriteState;
+
+void asio_async_write(AsioConn* conn, char* buf, int len, asio_write_cb cb, void* user_data){
+	if (conn==NULL){
+		cb(conn, true, user_data);
+		return;
+	}
+
+	enqueueOp(conn, conn->write_queue, [conn, buf, len, cb, user_data](){
+		if (conn->shm.region.map!=NULL){
+			return runBlocking(conn, conn->write_waiter, [conn, buf, len, cb, user_data](){
+				bool err;
+				asio_write(conn, buf, len, &err);
+				return [conn, cb, user_data, err](){
+					cb(conn, err, user_data);
+					finishOp(conn->write_queue);
+				};
+			});
+		}
+
+		auto state=std::make_shared<AsyncWriteState>();
+		std::vector<asio::const_buffer> buffers;
+
+		if (conn->backend->use_tcp){
+			uint8_t format;
+			const char* input;
+			uint32_t size;
+			try{
+				std::tie(format, input, size) = encodeFrame(conn, state->compressed_buf, buf, len, shouldCompress(conn, buf, len, len));
+			}
+			catch(asio::system_error& e){
+				cb(conn, true, user_data);
+				return finishOp(conn->write_queue);
+			}
+			state->format=format;
+
+			serializeInt(state->size_buf, 0, size);
+			serializeInt(state->size_buf, 4, len);
+			
+			buffers={asio::buffer(&state->format, 1), asio::buffer(state->size_buf), asio::buffer(input, size)};
+		}else{
+			packMessage(state->msg_buf.data(), WRITE, len, 0);
+			buffers={asio::buffer(state->msg_buf), asio::buffer(buf, len)};
+		}
+
+		asio::async_write(*conn->socket, buffers, asio::bind_executor(*conn->strand, [conn, state, cb, user_data](const asio::error_code& ec, size_t){
+			cb(conn, bool(ec), user_data);
+			finishOp(conn->write_queue);
+		}));
+	});
+}
+
+int asio_run(){
+	if (context.stopped()){
+		context.restart();
+	}
+	return context.run();
+}
+
+int asio_poll(){
+	if (context.stopped()){
+		context.restart();
+	}
+	return context.poll();
+}
+
+char* asio_get_buf(AsioConn* conn, uint32_t* cap){
+	try{
+		conn->output_buf.reserve(*cap);
+	}
+	catch(asio::system_error& e){
+		*cap=0;
+		return NULL;
+	}
 	*cap=conn->output_buf.capacity();
 
 	return conn->output_buf.data();
@@ -2,7 +2,13 @@
 
 typedef struct AsioConn AsioConn;
 
-AsioConn* asio_connect(int id);
+typedef struct {
+	char* buf;
+	int len;
+} AsioBuffer;
+
+AsioConn* asio_connect(int id); //Reuses an idle connection from the pool if there is one. Returns NULL if the backend can't be reached (after CONN_CONNECT_RETRIES attempts).
+void asio_prewarm(int id, int count); //Opens connections ahead of time, so the next count calls to asio_connect don't have to wait. Connections closed with asio_close go back to the pool (up to CONN_<PREFIX>_POOL_SIZE, or count if that's larger), so the backend should expect a connection to be reused.
 
 AsioConn* asio_server_init(int id);
 AsioConn* asio_server_accept(AsioConn* server);
@@ -10,6 +16,36 @@ AsioConn* asio_server_accept(AsioConn* server);
 void asio_close(AsioConn* conn);
 
 void asio_read(AsioConn* conn, char** buf, int* len, bool* err);
+//Buffered receive: the socket is read in chunks of up to size bytes, and messages that fit are handed out straight from that buffer. size <= 0 turns it off. Async reads bypass the buffer, so they should not be mixed with it.
+void asio_set_read_buffering(AsioConn* conn, int size);
+void asio_read_many(AsioConn* conn, AsioBuffer* msgs, int max, int* count, bool* err); //Waits for at least one message, then returns up to max that have already arrived. They are valid until the next read.
+//Read-ahead: a background thread keeps up to depth messages read (and decompressed) ahead of the application, so the next one arrives while the current one is being processed. Messages are still valid until the next read. depth <= 0 turns it off, once the read it's in the middle of has finished. A connection closed with messages still read ahead isn't reused.
+void asio_set_read_ahead(AsioConn* conn, int depth);
+
+void asio_read_into(AsioConn* conn, char* buf, int cap, int* len, bool* err); //Reads the next message straight into buf. If *len > cap, nothing was read, and the call should be retried with a buffer of at least *len bytes.
 void asio_write(AsioConn* conn, char* buf, int len, bool* err);
+void asio_writev(AsioConn* conn, AsioBuffer* bufs, int count, bool* err); //Sends the pieces as a single message, without concatenating them first
+
+//Streaming, for messages too big to build in memory all at once (or to fit in an int). asio_write_begin sends the size of the message, the message itself is then sent a chunk at a time with asio_write_chunk, and asio_write_end reports whether exactly that much was sent. Streamed messages are never compressed. Nothing else may be written to the connection until the message is done.
+void asio_write_begin(AsioConn* conn, uint64_t len, bool* err);
+void asio_write_chunk(AsioConn* conn, char* buf, int len, bool* err);
+void asio_write_end(AsioConn* conn, bool* err);
+//asio_read_begin starts reading the next message, however it was sent, and returns its size. asio_read_chunk then reads up to cap more bytes of it into buf, and sets *len to 0 once all of it has been read. Messages of 2 GB or more can only be read this way (other reads report an error, and leave the message for asio_read_begin). Only messages that weren't compressed are read in constant memory.
+void asio_read_begin(AsioConn* conn, uint64_t* len, bool* err);
+void asio_read_chunk(AsioConn* conn, char* buf, int cap, int* len, bool* err);
+
+//Batching: asio_write/asio_writev only queue the message, which is sent once max_bytes are queued, max_delay_us after the oldest queued message (if non-zero), or on asio_flush. max_bytes <= 0 turns it off. Async writes are not batched, and should not be mixed with batched ones.
+void asio_set_batching(AsioConn* conn, int max_bytes, int max_delay_us);
+void asio_flush(AsioConn* conn, bool* err);
 
 char* asio_get_buf(AsioConn* conn, uint32_t* cap);
+
+//Async variants --- operations on the same connection complete in the order they were submitted. The callbacks are called from whichever thread is running asio_run/asio_poll, and all pending operations on a connection must complete before it is closed.
+typedef void (*asio_read_cb)(AsioConn* conn, char* buf, int len, bool err, void* user_data); //buf is valid until the callback returns
+typedef void (*asio_write_cb)(AsioConn* conn, bool err, void* user_data);
+
+void asio_async_read(AsioConn* conn, asio_read_cb cb, void* user_data);
+void asio_async_write(AsioConn* conn, char* buf, int len, asio_write_cb cb, void* user_data); //buf must stay valid until cb is called
+
+int asio_run(); //Drives the shared io_context until there is no more pending work. Returns the number of handlers run.
+int asio_poll(); //Same as asio_run, but does not block
@@ -3,9 +3,65 @@
 #include <cstdio>
 #include <memory.h>
 #include <cstdlib>
+#include <vector>
 auto test_buf=new uint8_t[1024];
 char* actual_buf;
 bool err;
+
+#define CHUNK (1024*1024)
+#define BURST_SIZE (1024*1024)
+
+void fill(uint8_t* buf, size_t len, int seed, bool compressible){ //Same as in test_client.cpp
+	uint32_t state=seed*2654435761u+1;
+	for(size_t i=0; i<len; i++){
+		if (compressible){
+			buf[i]="abcdefgh"[(i/64+seed)%8];
+		}else{
+			state=state*1103515245+12345;
+			buf[i]=state>>24;
+		}
+	}
+}
+
+void check(const char* what){
+	if (err){
+		printf("%s failed!\n", what);
+		exit(1);
+	}
+}
+
+void echo(AsioConn* client, int count){ //Sends each message back as it was
+	for(int i=0; i < count; i++){
+		int len;
+		asio_read(client, &actual_buf, &len, &err);
+		check("asio_read");
+		asio_write(client, actual_buf, len, &err);
+		check("asio_write");
+	}
+}
+
+void echoStream(AsioConn* client){ //Same, but a chunk at a time
+	uint64_t len;
+	asio_read_begin(client, &len, &err);
+	check("asio_read_begin");
+	asio_write_begin(client, len, &err);
+	check("asio_write_begin");
+
+	std::vector<char> chunk(CHUNK);
+	for(;;){
+		int size;
+		asio_read_chunk(client, chunk.data(), chunk.size(), &size, &err);
+		check("asio_read_chunk");
+		if (size==0){
+			break;
+		}
+		asio_write_chunk(client, chunk.data(), size, &err);
+		check("asio_write_chunk");
+	}
+	asio_write_end(client, &err);
+	check("asio_write_end");
+}
+
 int main(int argc, char** argv){
 	auto acceptor=asio_server_init(0);
 
@@ -26,8 +82,51 @@ int main(int argc, char** argv){
 		asio_write(client, (char*)test_buf, 1024, &err);
 	}
 
+	echo(client, 5); //One message per frame format
+
+	{ //asio_writev: sent back in two pieces, so both sides send one
+		int len;
+		asio_read(client, &actual_buf, &len, &err);
+		check("asio_read");
+		AsioBuffer pieces[2]={{actual_buf, len/3}, {actual_buf+len/3, len-len/3}};
+		asio_writev(client, pieces, 2, &err);
+		check("asio_writev");
+	}
+
+	{ //asio_read_into
+		std::vector<char> into(1024*1024);
+		int len;
+		asio_read_into(client, into.data(), into.size(), &len, &err);
+		check("asio_read_into");
+		asio_write(client, into.data(), len, &err);
+		check("asio_write");
+	}
+
+	echo(client, 100); //Batching
+	echo(client, 50); //asio_read_many
+
+	asio_set_read_ahead(client, 4);
+	echo(client, 20);
+	asio_set_read_ahead(client, 0);
+
+	{ //More than the relay queues for one connection, so it has to PAUSE and RESUME the backend
+		int len;
+		asio_read(client, &actual_buf, &len, &err);
+		check("asio_read");
+		auto count=atoi(actual_buf);
+
+		std::vector<uint8_t> burst(BURST_SIZE);
+		for(int i=0; i < count; i++){
+			fill(burst.data(), burst.size(), i, i%2==0);
+			asio_write(client, (char*)burst.data(), burst.size(), &err);
+			check("asio_write");
+		}
+	}
 
-	
+	echo(client, 10); //Async
 
+	echoStream(client);
+	echoStream(client);
 
+	asio_close(client);
 }
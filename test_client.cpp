@@ -3,10 +3,131 @@
 #include <cstdio>
 #include <memory.h>
 #include <cstdlib>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <string>
 
 auto test_buf=new uint8_t[1024];
 char* actual_buf;
 bool err;
+
+#define CHUNK (1024*1024)
+#define BURST_SIZE (1024*1024)
+#define BURST_COUNT 32
+
+void fill(uint8_t* buf, size_t len, int seed, bool compressible){ //Compressible data gets sent as one of the LZ4 formats, the rest as-is
+	uint32_t state=seed*2654435761u+1;
+	for(size_t i=0; i<len; i++){
+		if (compressible){
+			buf[i]="abcdefgh"[(i/64+seed)%8];
+		}else{
+			state=state*1103515245+12345;
+			buf[i]=state>>24;
+		}
+	}
+}
+
+void check(const char* what){
+	if (err){
+		printf("%s failed!\n", what);
+		exit(1);
+	}
+}
+
+void compare(const char* what, const std::vector<uint8_t>& expected, const char* actual, int len){
+	if (len!=(int)expected.size() || memcmp(expected.data(), actual, len)){
+		printf("%s: buffers don't match! (got %i bytes, expected %zu)\n", what, len, expected.size());
+		exit(1);
+	}
+}
+
+std::vector<uint8_t> message(size_t len, int seed, bool compressible){
+	std::vector<uint8_t> result(len);
+	fill(result.data(), len, seed, compressible);
+	return result;
+}
+
+void roundTrip(AsioConn* client, const char* what, const std::vector<uint8_t>& msg){
+	asio_write(client, (char*)msg.data(), msg.size(), &err);
+	check("asio_write");
+	int len;
+	asio_read(client, &actual_buf, &len, &err);
+	check("asio_read");
+	compare(what, msg, actual_buf, len);
+}
+
+std::vector<std::vector<uint8_t>> async_msgs;
+int async_writes=0, async_reads=0;
+
+void onWrite(AsioConn* conn, bool err, void* user_data){
+	if (err){
+		printf("asio_async_write failed!\n");
+		exit(1);
+	}
+	async_writes++;
+}
+
+void onRead(AsioConn* conn, char* buf, int len, bool err, void* user_data){
+	if (err){
+		printf("asio_async_read failed!\n");
+		exit(1);
+	}
+	compare("async", async_msgs[(intptr_t)user_data], buf, len);
+	async_reads++;
+}
+
+void streamRoundTrip(AsioConn* client, uint64_t size){ //Chunk i is filled with i, so it can be checked without holding the whole message
+	std::thread writer([client, size](){
+		bool err;
+		std::vector<char> chunk(CHUNK);
+		asio_write_begin(client, size, &err);
+		for(uint64_t sent=0; !err && sent < size; sent+=CHUNK){
+			auto len=(int)std::min<uint64_t>(CHUNK, size-sent);
+			memset(chunk.data(), (uint8_t)(sent/CHUNK), len);
+			asio_write_chunk(client, chunk.data(), len, &err);
+		}
+		if (!err){
+			asio_write_end(client, &err);
+		}
+		if (err){
+			printf("Streaming write failed!\n");
+			exit(1);
+		}
+	}); //The backend sends it back while it's still being sent, so it has to be read at the same time
+
+	uint64_t len;
+	asio_read_begin(client, &len, &err);
+	check("asio_read_begin");
+	if (len!=size){
+		printf("Streamed message is %lu bytes, expected %lu\n", (unsigned long)len, (unsigned long)size);
+		exit(1);
+	}
+
+	std::vector<char> chunk(CHUNK), expected(CHUNK);
+	uint64_t received=0;
+	for(;;){
+		int got;
+		asio_read_chunk(client, chunk.data(), chunk.size(), &got, &err);
+		check("asio_read_chunk");
+		if (got==0){
+			break;
+		}
+		memset(expected.data(), (uint8_t)(received/CHUNK), got);
+		if (received%CHUNK!=0 || memcmp(chunk.data(), expected.data(), got)){
+			printf("Streamed chunk at %lu doesn't match!\n", (unsigned long)received);
+			exit(1);
+		}
+		received+=got;
+	}
+	writer.join();
+
+	if (received!=size){
+		printf("Only got %lu of %lu streamed bytes\n", (unsigned long)received, (unsigned long)size);
+		exit(1);
+	}
+}
+
 int main(int argc, char** argv){
 	auto client=asio_connect(0);
 
@@ -31,6 +152,139 @@ int main(int argc, char** argv){
 		}
 	}
 
+	//Over TCP, each of these goes out as a different frame format (if compression is on for the backend)
+	roundTrip(client, "FRAME_RAW", message(1000, 1, false));
+	roundTrip(client, "FRAME_LZ4", message(200000, 2, true));
+	roundTrip(client, "FRAME_RAW (incompressible)", message(200000, 3, false));
+	roundTrip(client, "FRAME_LZ4_STREAM", message(50000, 7, true)); //Under STREAM_MAX_MESSAGE, so it's streamed when the backend has stream compression on (FRAME_LZ4 otherwise)
+	roundTrip(client, "FRAME_LZ4_PARALLEL", message(6*1024*1024, 4, true));
+
+	{ //FRAME_LZ4_BLOCKS
+		auto msg=message(300000, 5, true);
+		AsioBuffer pieces[3]={{(char*)msg.data(), 1000}, {(char*)msg.data()+1000, 100000}, {(char*)msg.data()+101000, 199000}};
+		asio_writev(client, pieces, 3, &err);
+		check("asio_writev");
+		int len;
+		asio_read(client, &actual_buf, &len, &err);
+		check("asio_read");
+		compare("asio_writev", msg, actual_buf, len);
+	}
+
+	{ //asio_read_into, starting with a buffer that's too small
+		auto msg=message(100000, 6, true);
+		asio_write(client, (char*)msg.data(), msg.size(), &err);
+		check("asio_write");
+
+		std::vector<char> into(10);
+		int len;
+		asio_read_into(client, into.data(), into.size(), &len, &err);
+		check("asio_read_into");
+		if (len!=(int)msg.size()){
+			printf("asio_read_into should have asked for %zu bytes, not %i\n", msg.size(), len);
+			exit(1);
+		}
+		into.resize(len);
+		asio_read_into(client, into.data(), into.size(), &len, &err);
+		check("asio_read_into");
+		compare("asio_read_into", msg, into.data(), len);
+	}
+
+	{ //Batching
+		std::vector<std::vector<uint8_t>> msgs;
+		for(int i=0; i < 100; i++){
+			msgs.push_back(message(100+i*37, 100+i, i%2==0));
+		}
+		asio_set_batching(client, 64*1024, 1000);
+		for(auto& msg: msgs){
+			asio_write(client, (char*)msg.data(), msg.size(), &err);
+			check("asio_write (batched)");
+		}
+		asio_flush(client, &err);
+		check("asio_flush");
+		asio_set_batching(client, 0, 0);
+
+		for(auto& msg: msgs){
+			int len;
+			asio_read(client, &actual_buf, &len, &err);
+			check("asio_read");
+			compare("batching", msg, actual_buf, len);
+		}
+	}
+
+	{ //asio_read_many
+		std::vector<std::vector<uint8_t>> msgs;
+		for(int i=0; i < 50; i++){
+			msgs.push_back(message(10+i*101, 200+i, i%3==0));
+		}
+		for(auto& msg: msgs){
+			asio_write(client, (char*)msg.data(), msg.size(), &err);
+			check("asio_write");
+		}
+
+		asio_set_read_buffering(client, 64*1024);
+		size_t received=0;
+		while(received < msgs.size()){
+			AsioBuffer got[16];
+			int count;
+			asio_read_many(client, got, 16, &count, &err);
+			check("asio_read_many");
+			for(int i=0; i < count && received < msgs.size(); i++){
+				compare("asio_read_many", msgs[received++], got[i].buf, got[i].len);
+			}
+		}
+		asio_set_read_buffering(client, 0);
+	}
+
+	{ //Read-ahead
+		std::vector<std::vector<uint8_t>> msgs;
+		for(int i=0; i < 20; i++){
+			msgs.push_back(message(1000+i*5000, 300+i, i%2==0));
+		}
+		asio_set_read_ahead(client, 4);
+		for(auto& msg: msgs){
+			asio_write(client, (char*)msg.data(), msg.size(), &err);
+			check("asio_write");
+		}
+		for(auto& msg: msgs){
+			int len;
+			asio_read(client, &actual_buf, &len, &err);
+			check("asio_read (read-ahead)");
+			compare("read-ahead", msg, actual_buf, len);
+		}
+		asio_set_read_ahead(client, 0);
+	}
+
+	{ //Not reading for a while makes the relay PAUSE the backend, and RESUME it once this catches up
+		auto count=std::to_string(BURST_COUNT);
+		asio_write(client, (char*)count.c_str(), count.size()+1, &err);
+		check("asio_write");
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+		for(int i=0; i < BURST_COUNT; i++){
+			int len;
+			asio_read(client, &actual_buf, &len, &err);
+			check("asio_read");
+			compare("PAUSE/RESUME", message(BURST_SIZE, i, i%2==0), actual_buf, len);
+		}
+	}
+
+	for(int i=0; i < 10; i++){ //Async
+		async_msgs.push_back(message(500+i*20000, 400+i, i%2==0));
+	}
+	for(size_t i=0; i < async_msgs.size(); i++){
+		asio_async_write(client, (char*)async_msgs[i].data(), async_msgs[i].size(), onWrite, NULL);
+		asio_async_read(client, onRead, (void*)(intptr_t)i);
+	}
+	asio_run();
+	if (async_writes!=(int)async_msgs.size() || async_reads!=(int)async_msgs.size()){
+		printf("Only %i async writes and %i async reads completed\n", async_writes, async_reads);
+		exit(1);
+	}
 
+	streamRoundTrip(client, 3*CHUNK+123);
+	auto large=getenv("TEST_STREAM_SIZE"); //Past 4 GB by default, so it needs FRAME_LARGE over TCP and WRITE_HIGH through the relay
+	streamRoundTrip(client, large!=NULL ? strtoull(large, NULL, 10) : (uint64_t(1) << 32) + 4096);
 
+	asio_close(client);
+	printf("All tests passed\n");
 }
@@ -2,6 +2,15 @@
 #include <asio/io_context.hpp>
 #include <cstdint>
 #include <format>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <bit>
+#include <mutex>
+#include <new>
+#include <sys/socket.h>
+#include <thread>
+#include <chrono>
 
 #ifdef __APPLE__
 	#include <sys/disk.h>
@@ -43,6 +52,270 @@ void writeToConn(socket_type& socket, std::array<uint8_t, 12> buf, MessageType m
 	asio::write(socket, asio::buffer(buf));
 }
 
+std::tuple <MessageType, uint32_t, uint32_t> readWithFd(socket_type& socket, std::array<uint8_t, 12>& buf, int* fd){ //Same as readFromConn, but also picks up a file descriptor sent along with the message (-1 if there isn't one)
+	*fd = -1;
+
+	iovec iov = {buf.data(), buf.size()};
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t received;
+	do{
+		received = recvmsg(socket.native_handle(), &msg, 0);
+	} while(received < 0 && errno == EINTR);
+	if (received <= 0){
+		throw asio::system_error(received == 0 ? asio::error::eof : asio::error_code(errno, asio::error::get_system_category()));
+	}
+
+	for(auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+	if ((size_t)received < buf.size()){
+		asio::read(socket, asio::buffer(buf.data()+received, buf.size()-received));
+	}
+
+	auto [msg_type, arg1, arg2] = unpackMessage(buf.data());
+	return {static_cast<MessageType>(msg_type), arg1, arg2};
+}
+
+void writeWithFd(socket_type& socket, std::array<uint8_t, 12>& buf, MessageType msg_type, uint32_t arg1, uint32_t arg2, int fd){ //Same as writeToConn, but also sends fd (if it isn't -1). Only works on UNIX sockets.
+	packMessage(buf.data(), static_cast<uint32_t>(msg_type), arg1, arg2);
+	if (fd < 0){
+		asio::write(socket, asio::buffer(buf));
+		return;
+	}
+
+	iovec iov = {buf.data(), buf.size()};
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	auto cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	ssize_t sent;
+	do{
+		sent = sendmsg(socket.native_handle(), &msg, 0);
+	} while(sent < 0 && errno == EINTR);
+	if (sent < 0){
+		throw asio::system_error(asio::error_code(errno, asio::error::get_system_category()));
+	}
+	if ((size_t)sent < buf.size()){ //The descriptor went with the first byte
+		asio::write(socket, asio::buffer(buf.data()+sent, buf.size()-sent));
+	}
+}
+
+static uint64_t shmRingSpace(uint64_t ring_size){ //Header and data of one ring, rounded up so the next header stays aligned
+	return sizeof(ShmRingHeader) + ((ring_size + 63) & ~(uint64_t)63);
+}
+
+int shmCreate(uint64_t ring_size){ //Returns -1 if it couldn't be made
+	#ifdef __linux__
+		int fd = memfd_create("conn_shm", MFD_CLOEXEC);
+	#else //No memfd, so make a named one and unlink it right away
+		static std::atomic<int> counter = 0;
+		auto name = std::format("/conn_shm.{}.{}", getpid(), counter++);
+		int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0){
+			shm_unlink(name.c_str());
+		}
+	#endif
+	if (fd < 0){
+		return -1;
+	}
+	if (ftruncate(fd, 2*shmRingSpace(ring_size)) != 0){ //Comes zeroed, so both rings start out empty
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+bool shmMap(int fd, uint64_t ring_size, ShmRegion& region){ //fd can be closed afterwards
+	region.map_size = 2*shmRingSpace(ring_size);
+	auto map = mmap(NULL, region.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED){
+		region.map = NULL;
+		return false;
+	}
+	region.map = static_cast<uint8_t*>(map);
+
+	int i = 0;
+	for(auto ring: {&region.to_server, &region.to_client}){
+		ring->header = reinterpret_cast<ShmRingHeader*>(region.map + i*shmRingSpace(ring_size));
+		ring->data = reinterpret_cast<uint8_t*>(ring->header + 1);
+		ring->size = ring_size;
+		i++;
+	}
+	return true;
+}
+
+void shmUnmap(ShmRegion& region){
+	if (region.map != NULL){
+		munmap(region.map, region.map_size);
+		region.map = NULL;
+	}
+}
+
+size_t shmWrite(ShmRing& ring, const uint8_t* data, size_t size){ //Never blocks, so it can write less than size
+	auto head = ring.header->head.load();
+	auto tail = ring.header->tail.load(std::memory_order_relaxed);
+	size = std::min<size_t>(size, ring.size - (tail - head));
+
+	auto offset = tail % ring.size;
+	auto first = std::min<size_t>(size, ring.size - offset);
+	memcpy(ring.data + offset, data, first);
+	memcpy(ring.data, data + first, size - first);
+
+	ring.header->tail.store(tail + size); //Sequentially consistent, so shmShouldWake can't see waiting from before it
+	return size;
+}
+
+size_t shmRead(ShmRing& ring, uint8_t* data, size_t size){ //Same as shmWrite
+	size_t read = 0;
+	while(read < size){
+		auto [src, available] = shmPeek(ring);
+		if (available == 0){
+			break;
+		}
+		available = std::min(available, size - read);
+		memcpy(data + read, src, available);
+		shmConsume(ring, available);
+		read += available;
+	}
+	return read;
+}
+
+std::tuple<uint8_t*, size_t> shmPeek(ShmRing& ring){ //What can be read without wrapping around
+	auto head = ring.header->head.load(std::memory_order_relaxed);
+	auto tail = ring.header->tail.load();
+	auto offset = head % ring.size;
+	return {ring.data + offset, std::min<uint64_t>(tail - head, ring.size - offset)};
+}
+
+void shmConsume(ShmRing& ring, size_t size){
+	ring.header->head.store(ring.header->head.load(std::memory_order_relaxed) + size);
+}
+
+bool shmWait(ShmRing& ring, bool for_space){ //Tells the other side we're about to block on the ring, then checks it again. Returns whether it's still worth blocking.
+	ring.header->waiting.store(1);
+	auto head = ring.header->head.load();
+	auto tail = ring.header->tail.load();
+	return for_space ? tail - head == ring.size : tail == head;
+}
+
+bool shmShouldWake(ShmRing& ring){ //After changing the ring: whether the other side has to be sent a byte
+	return ring.header->waiting.load() != 0 && ring.header->waiting.exchange(0) != 0;
+}
+
+#define POOL_MIN_CLASS 4096
+#define POOL_MAX_CLASS (size_t(1) << 31) //Anything larger is rare enough that it isn't kept
+#define HUGE_CLASS (2*1024*1024) //Classes at least this large are mapped directly
+
+static size_t POOL_LIMIT = std::max(getEnv("CONN_BUFFER_POOL_LIMIT", 64*1024*1024), 0);
+static size_t MEMORY_LIMIT = std::stoull(getEnv("CONN_BUFFER_MEMORY_LIMIT", std::to_string(size_t(8) << 30))); //0 for no limit
+static std::atomic<size_t> in_use = 0; //Bytes handed out by poolAllocate that haven't come back yet
+static bool HUGEPAGES = getEnv("CONN_BUFFER_HUGEPAGES", 1);
+
+typedef struct {
+	std::mutex mu;
+	std::array<std::vector<void*>, 32> free_lists; //Indexed by the log2 of the size class
+	size_t idle = 0; //Bytes in free_lists
+} BufferPool;
+
+static BufferPool& bufferPool(){
+	static auto pool = new BufferPool(); //Never destroyed, since detached threads may still be giving buffers back while the process exits
+	return *pool;
+}
+
+static void* mapBlock(size_t size){
+	void* ptr = MAP_FAILED;
+	#ifdef MAP_HUGETLB
+		if (HUGEPAGES && size % HUGE_CLASS == 0){
+			ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0); //Only works if hugepages have been set aside
+		}
+	#endif
+	if (ptr == MAP_FAILED){
+		ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED){
+			return NULL;
+		}
+		#ifdef MADV_HUGEPAGE
+			if (HUGEPAGES){
+				madvise(ptr, size, MADV_HUGEPAGE);
+			}
+		#endif
+	}
+	return ptr;
+}
+
+size_t poolSizeClass(size_t size){
+	if (size <= POOL_MIN_CLASS){
+		return POOL_MIN_CLASS;
+	}else if (size > POOL_MAX_CLASS){
+		return (size + POOL_MIN_CLASS - 1) & ~size_t(POOL_MIN_CLASS - 1);
+	}
+	return std::bit_ceil(size);
+}
+
+void* poolAllocate(size_t size){
+	if (in_use.fetch_add(size) + size > MEMORY_LIMIT && MEMORY_LIMIT != 0){ //Fails the one operation that asked for it, instead of the whole process
+		in_use -= size;
+		throw asio::system_error(asio::error::no_buffer_space);
+	}
+
+	if (size <= POOL_MAX_CLASS){
+		auto& pool = bufferPool();
+		std::scoped_lock lk(pool.mu);
+		auto& free_list = pool.free_lists[std::countr_zero(size)];
+		if (!free_list.empty()){
+			auto ptr = free_list.back();
+			free_list.pop_back();
+			pool.idle -= size;
+			return ptr;
+		}
+	}
+
+	auto ptr = (size >= HUGE_CLASS) ? mapBlock(size) : malloc(size);
+	if (ptr == NULL){
+		in_use -= size;
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+void poolFree(void* ptr, size_t size){
+	if (ptr == NULL){
+		return;
+	}
+	in_use -= size;
+	if (size <= POOL_MAX_CLASS){
+		auto& pool = bufferPool();
+		std::scoped_lock lk(pool.mu);
+		if (pool.idle + size <= POOL_LIMIT){
+			pool.free_lists[std::countr_zero(size)].push_back(ptr);
+			pool.idle += size;
+			return;
+		}
+	}
+
+	if (size >= HUGE_CLASS){
+		munmap(ptr, size);
+	}else{
+		free(ptr);
+	}
+}
 
 std::string getEnv(std::string _key, std::string _default){
 	auto result=std::getenv(_key.c_str());
@@ -64,7 +337,7 @@ int getEnv(std::string _key, int _default){
 
 
 
-BackendInfo backends[] = { {.prefix="STREAM", .port = 9000, .compression=true} , {.prefix="CLIP", .port= 9001}, {.prefix="AV", .port = 9002}};
+BackendInfo backends[] = { {.prefix="STREAM", .port = 9000, .compression=true, .priority=0} , {.prefix="CLIP", .port= 9001}, {.prefix="AV", .port = 9002}};
 
 BackendInfo* getBackend(int id, BackendInfo** ret){
 	auto backend =&backends[id];
@@ -76,6 +349,22 @@ BackendInfo* getBackend(int id, BackendInfo** ret){
 		backend->port=getEnv("CONN_PORT", getEnv(std::format("CONN_{}_PORT", backend->prefix),backend->port));
 		
 		backend->use_tcp = getEnv("CONN_USE_TCP", getEnv(std::format("CONN_{}_USE_TCP", backend->prefix), backend->use_tcp));
+
+		backend->compression = getEnv(std::format("CONN_{}_COMPRESSION", backend->prefix), backend->compression);
+		backend->stream_compression = getEnv(std::format("CONN_{}_STREAM_COMPRESSION", backend->prefix), backend->stream_compression);
+
+		backend->pool_size = getEnv(std::format("CONN_{}_POOL_SIZE", backend->prefix), backend->pool_size);
+		backend->priority = std::clamp(getEnv(std::format("CONN_{}_PRIORITY", backend->prefix), backend->priority), 0, 2);
+		backend->shm_size = std::max(getEnv(std::format("CONN_{}_SHM_SIZE", backend->prefix), backend->shm_size), 0);
+
+		auto dictionary_file = getEnv(std::format("CONN_{}_DICTIONARY", backend->prefix), "");
+		if (!dictionary_file.empty()){
+			std::ifstream file(dictionary_file, std::ios::binary);
+			backend->dictionary.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+			if (backend->dictionary.size() > 64*1024){ //LZ4 only looks back 64 KB
+				backend->dictionary.erase(0, backend->dictionary.size()-64*1024);
+			}
+		}
 		backend->resolved=true;
 	}
 	backend->mu.unlock();
@@ -87,30 +376,57 @@ BackendInfo* getBackend(int id, BackendInfo** ret){
 	return backend;
 }
 
-void connectToBackend(BackendInfo* backend, socket_ptr& socket, asio::io_context& context){
-	ip::tcp::resolver resolver(context);
+int CONNECT_RETRIES = getEnv("CONN_CONNECT_RETRIES", 10); //Before giving up on a backend
+static int CONNECT_MAX_BACKOFF = getEnv("CONN_CONNECT_MAX_BACKOFF_MS", 1000);
 
-	auto resolver_conns=resolver.resolve(backend->address, std::to_string(backend->port));
+std::chrono::milliseconds connectBackoff(int attempt){ //How long to wait before the next attempt
+	return std::chrono::milliseconds(std::min<int64_t>(CONNECT_MAX_BACKOFF, int64_t(10) << std::min(attempt, 20)));
+}
 
-	std::vector<ip::tcp::resolver::endpoint_type> endpoints;
+std::vector<ip::tcp::endpoint> resolveBackend(BackendInfo* backend){ //Only does a lookup if there's nothing cached. Throws if the lookup fails.
+	{
+	std::scoped_lock lk(backend->mu);
+	if (!backend->endpoints.empty()){
+		return backend->endpoints;
+	}
+	}
 
-	for(auto& conn: resolver_conns){
+	asio::io_context context;
+	ip::tcp::resolver resolver(context);
+	std::vector<ip::tcp::endpoint> endpoints;
+	for(auto& conn: resolver.resolve(backend->address, std::to_string(backend->port))){
 		endpoints.push_back(conn.endpoint());
 	}
-	
+
+	std::scoped_lock lk(backend->mu);
+	backend->endpoints = endpoints;
+	return endpoints;
+}
+
+void forgetEndpoints(BackendInfo* backend){ //None of them worked, so the address may have changed
+	std::scoped_lock lk(backend->mu);
+	backend->endpoints.clear();
+}
+
+void connectToBackend(BackendInfo* backend, socket_ptr& socket, asio::io_context& context){ //Throws once CONNECT_RETRIES attempts have failed
 	socket=std::make_unique<socket_type>(context, TCP);
-	
-	asio::error_code ec;
-	while (true){
-		asio::connect(*socket, endpoints, ec);
-		if (!ec){
-		    break;
+
+	for(int attempt = 0;; attempt++){
+		try{
+			asio::connect(*socket, resolveBackend(backend));
+			break;
+		}
+		catch(asio::system_error& e){
+			forgetEndpoints(backend);
+			if (attempt + 1 >= CONNECT_RETRIES){
+				throw;
+			}
+			std::this_thread::sleep_for(connectBackoff(attempt));
 		}
 	}
 	socket->set_option( asio::ip::tcp::no_delay(true) );	
 }
 
-
 void connectToBackend(int id, socket_ptr& socket, asio::io_context& context){
 	return connectToBackend(getBackend(id), socket, context);
 }
@@ -4,6 +4,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <utility>
 
 namespace ip = asio::ip;
 namespace local = asio::local;
@@ -15,7 +19,11 @@ enum MessageType{
 	WRITE,
 	DISCONNECT,
 	DATA, 
-	DUMMY
+	DUMMY,
+	PADDING, //Fills up the end of the ring when a record doesn't fit there (or, with a size, takes the place of a DATA record that couldn't be filled in)
+	PAUSE, //Stop sending on this connection, since it has too much queued up on the other side
+	RESUME,
+	WRITE_HIGH //Only in the ring: the upper 32 bits of the size of the WRITE right after it
 };
 
 typedef asio::generic::stream_protocol::socket socket_type;
@@ -31,6 +39,40 @@ void serializeInt(uint8_t* buf, int i, uint32_t val);
 
 std::tuple <MessageType, uint32_t, uint32_t> readFromConn(socket_type& socket, std::array<uint8_t, 12> buf);
 void writeToConn(socket_type& socket, std::array<uint8_t, 12> buf, MessageType msg_type, uint32_t arg1, uint32_t arg2);
+std::tuple <MessageType, uint32_t, uint32_t> readWithFd(socket_type& socket, std::array<uint8_t, 12>& buf, int* fd);
+void writeWithFd(socket_type& socket, std::array<uint8_t, 12>& buf, MessageType msg_type, uint32_t arg1, uint32_t arg2, int fd);
+
+/*
+Shared memory between a client and the relay on the same machine (see BackendInfo::shm_size). The relay makes it, and passes it over the UNIX socket along with the CONFIRM. It holds one byte ring per direction, carrying exactly what would have gone over the socket. After that, the socket only carries wakeups: a side that is about to block on a ring sets its waiting flag, and whoever changes the ring next sends a byte.
+*/
+typedef struct {
+	alignas(64) std::atomic<uint64_t> head; //Only written by the reader...
+	alignas(64) std::atomic<uint64_t> tail; //...and this only by the writer
+	alignas(64) std::atomic<uint32_t> waiting;
+} ShmRingHeader;
+
+typedef struct {
+	ShmRingHeader* header = NULL;
+	uint8_t* data = NULL;
+	uint64_t size = 0;
+} ShmRing;
+
+typedef struct {
+	uint8_t* map = NULL;
+	size_t map_size = 0;
+	ShmRing to_server; //Written by the client
+	ShmRing to_client;
+} ShmRegion;
+
+int shmCreate(uint64_t ring_size);
+bool shmMap(int fd, uint64_t ring_size, ShmRegion& region);
+void shmUnmap(ShmRegion& region);
+size_t shmWrite(ShmRing& ring, const uint8_t* data, size_t size);
+size_t shmRead(ShmRing& ring, uint8_t* data, size_t size);
+std::tuple<uint8_t*, size_t> shmPeek(ShmRing& ring);
+void shmConsume(ShmRing& ring, size_t size);
+bool shmWait(ShmRing& ring, bool for_space);
+bool shmShouldWake(ShmRing& ring);
 
 typedef struct {
 	std::string prefix;
@@ -40,12 +82,24 @@ typedef struct {
 	bool use_tcp = true; //However, hopefully, at some point, we can either fully depreciate using TCP, or gate it behind some more conditions so only a few people actually need it enabled.
 
 	bool compression = false;
+	bool stream_compression = false; //Small messages are compressed against the earlier ones on the connection
+	std::string dictionary; //Preloaded history for stream compression. Both ends of a connection must use the same one.
+
+	int pool_size = 0; //How many idle connections asio_close keeps around for asio_connect to reuse
+	int priority = 1; //On the relay's ring, from 0 (bulk) to 2 (interactive)
+
+	int shm_size = 0; //When not using TCP, the size of each ring in the shared memory the relay hands over (0 means everything goes over the UNIX socket)
 
 	bool resolved = false;
+	std::vector<ip::tcp::endpoint> endpoints; //Resolved on the first connect, and again after every endpoint has failed
 
 	std::mutex mu;
 } BackendInfo;
 
+extern int CONNECT_RETRIES;
+std::chrono::milliseconds connectBackoff(int attempt);
+std::vector<ip::tcp::endpoint> resolveBackend(BackendInfo* backend);
+void forgetEndpoints(BackendInfo* backend);
 void connectToBackend(int id, socket_ptr& socket, asio::io_context& context);
 void connectToBackend(BackendInfo* id, socket_ptr& socket, asio::io_context& context);
 BackendInfo* getBackend(int id, BackendInfo** ret = NULL);
@@ -56,38 +110,75 @@ std::tuple<uint32_t, uint32_t, uint32_t> unpackMessage(uint8_t* buf);
 std::string getEnv(std::string _key, std::string _default);
 int getEnv(std::string _key, int _default);
 
+/*
+Memory for buffer<T> comes from one pool for the whole process, in power-of-two size classes, so connections hand what they're done with to the next one instead of every connection reallocating its way up from nothing. How much idle memory the pool keeps is capped by CONN_BUFFER_POOL_LIMIT, and how much can be in use at once by CONN_BUFFER_MEMORY_LIMIT (past that, poolAllocate throws asio::error::no_buffer_space, which fails just the operation that needed it). Large classes are mapped directly, and backed by hugepages (or transparent hugepages, if none have been set aside) unless CONN_BUFFER_HUGEPAGES is 0.
+*/
+size_t poolSizeClass(size_t size);
+void* poolAllocate(size_t size); //size has to come from poolSizeClass
+void poolFree(void* ptr, size_t size);
+
+#define BUFFER_SHRINK_MIN (1024*1024) //Smaller buffers are kept between uses
+
 template<typename T> class buffer { //Since we can't guarentee that vector.reserve will make the data at (data()+size(), data()+capacity()] usable (On GCC at least, this seems to be true though).
 	private:
-		std::unique_ptr<T> buf = NULL;
-		uint32_t cap = 0;
+		T* buf = NULL;
+		size_t cap = 0; //In bytes, like everything else here
+
+		void resize(size_t new_cap, bool keep){
+			new_cap = poolSizeClass(new_cap);
+			auto new_buf = (T*)poolAllocate(new_cap);
+			if (keep && buf != NULL){
+				memcpy(new_buf, buf, std::min(cap, new_cap));
+			}
+			poolFree(buf, cap);
+			buf = new_buf;
+			cap = new_cap;
+		}
 	public:
+		buffer() = default;
+		buffer(const buffer&) = delete;
+		buffer(buffer&& other) : buf(std::exchange(other.buf, (T*)NULL)), cap(std::exchange(other.cap, 0)) {}
+		buffer& operator=(buffer&& other){
+			std::swap(buf, other.buf);
+			std::swap(cap, other.cap);
+			return *this;
+		}
+		~buffer(){
+			release();
+		}
+
 		uint32_t capacity(){
-			return cap;
+			return std::min<size_t>(cap, UINT32_MAX);
 		}
 
 		T* data() {
-			return buf.get();
+			return buf;
 		}
 
-		void reserve(uint32_t new_cap){
+		void reserve(uint32_t new_cap){ //Keeps what's already in the buffer
 			if (cap >= new_cap){
 				return;
-			}else{
-				#if 1 //Bit-fiddling --- see https://stackoverflow.com/questions/466204/rounding-up-to-next-power-of-2
-					new_cap--;
-					new_cap |= new_cap >> 1;
-					new_cap |= new_cap >> 2;
-					new_cap |= new_cap >> 4;
-					new_cap |= new_cap >> 8;
-					new_cap |= new_cap >> 16;
-				#else //In C++20
-					new_cap=std::bit_ceil(new_cap);	
-				#endif
-				auto old_ptr = buf.release();
-				buf.reset((T*)realloc(old_ptr, new_cap));
-				cap=new_cap;
-				return;
-				
 			}
+			resize(new_cap, true);
+		}
+
+		void prepare(uint32_t size){ //Like reserve, but for when the old contents aren't needed anymore. That lets a buffer that's much bigger than what it's needed for shrink, so one huge message doesn't pin its memory forever.
+			if (cap < size || (cap > BUFFER_SHRINK_MIN && poolSizeClass(size) <= cap/4)){
+				resize(std::max<size_t>(size, std::min<size_t>(cap, BUFFER_SHRINK_MIN)), false);
+			}
+		}
+
+		void trim(){ //For scratch space, once it's been used: a large buffer goes back to the pool right away, instead of waiting for the next message
+			if (cap > BUFFER_SHRINK_MIN){
+				release();
+			}
+		}
+
+		void release(){ //Gives the memory back to the pool
+			if (buf != NULL){
+				poolFree(buf, cap);
+			}
+			buf = NULL;
+			cap = 0;
 		}
 };